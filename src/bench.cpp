@@ -0,0 +1,128 @@
+#include "bench.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Pattern {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+constexpr size_t kPatternSize = 1 << 20;
+
+std::vector<uint8_t> Periodic(const std::vector<uint8_t>& period) {
+    std::vector<uint8_t> data(kPatternSize);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = period[i % period.size()];
+    return data;
+}
+
+std::vector<uint8_t> Noise(int alphabet, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> data(kPatternSize);
+    for (auto& b : data) b = 'a' + rng() % alphabet;
+    return data;
+}
+
+std::vector<Pattern> MakePatterns() {
+    std::vector<Pattern> patterns;
+    // random bytes are the baseline: nothing matches, so the chains stay short.
+    patterns.push_back({"random", Noise(256, 1)});
+    // the classics. every position matches every earlier position, which is what used to stall us.
+    patterns.push_back({"zeros", std::vector<uint8_t>(kPatternSize, 0)});
+    patterns.push_back({"period-2", Periodic({'a', 'b'})});
+    patterns.push_back({"period-3", Periodic({'x', 'y', 'z'})});
+    // a period just past the maximum match length, so no single match covers a full period.
+    std::vector<uint8_t> long_period = Noise(256, 2);
+    long_period.resize(257);
+    patterns.push_back({"period-257", Periodic(long_period)});
+    // two-letter noise: every hash bucket is crowded and matches are long-ish but never "nice".
+    patterns.push_back({"binary-noise", Noise(2, 3)});
+    // mostly zeros with a sprinkle of noise, like a sparse disk image.
+    std::vector<uint8_t> sparse(kPatternSize, 0);
+    std::mt19937 rng(4);
+    for (size_t i = 0; i < sparse.size(); i += 4096) sparse[i + rng() % 4096] = rng();
+    patterns.push_back({"sparse", sparse});
+    return patterns;
+}
+
+// the non-blocking api is fed in small uneven pieces, with output room to match, so both contexts have to stop
+// and pick up again mid-header and mid-block. returns whether 'data' comes back out.
+constexpr size_t kStreamInPiece = 4093;
+constexpr size_t kStreamOutPiece = 1021;
+
+bool StreamRoundTrip(const std::vector<uint8_t>& data, const CompressOptions& options) {
+    CompressContext compressor(options);
+    std::vector<uint8_t> compressed;
+    uint8_t buf[kStreamOutPiece];
+    size_t in_pos = 0;
+    StreamStatus status;
+    do {
+        StreamBuffers io;
+        io.next_in = data.data() + in_pos;
+        io.avail_in = std::min(kStreamInPiece, data.size() - in_pos);
+        io.next_out = buf;
+        io.avail_out = sizeof(buf);
+        bool finish = in_pos + io.avail_in == data.size();
+        status = compressor.Process(io, finish);
+        in_pos = io.next_in - data.data();
+        compressed.insert(compressed.end(), buf, io.next_out);
+    } while (status != StreamStatus::kEnd && status != StreamStatus::kError);
+    if (status == StreamStatus::kError) return false;
+
+    DecompressContext decompressor;
+    std::vector<uint8_t> restored;
+    in_pos = 0;
+    do {
+        StreamBuffers io;
+        io.next_in = compressed.data() + in_pos;
+        io.avail_in = std::min(kStreamInPiece, compressed.size() - in_pos);
+        io.next_out = buf;
+        io.avail_out = sizeof(buf);
+        status = decompressor.Process(io);
+        in_pos = io.next_in - compressed.data();
+        restored.insert(restored.end(), buf, io.next_out);
+        // a decompressor that wants more than the whole frame never finishes.
+        if (status == StreamStatus::kNeedInput && in_pos == compressed.size()) return false;
+    } while (status != StreamStatus::kEnd && status != StreamStatus::kError);
+    return status == StreamStatus::kEnd && restored == data;
+}
+
+} // namespace
+
+int RunAdversarialBench(const CompressOptions& options) {
+    int failures = 0;
+    double baseline_ns = 0;
+
+    std::cout << std::left << std::setw(14) << "pattern" << std::right
+              << std::setw(12) << "ns/byte" << std::setw(12) << "MB/s" << std::setw(10) << "ratio"
+              << std::setw(12) << "vs random" << "\n";
+
+    for (const Pattern& p : MakePatterns()) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::vector<uint8_t> compressed = CompressBuffer(p.data, options);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        std::vector<uint8_t> restored;
+        bool ok = DecompressBuffer(compressed, restored) && restored == p.data;
+        bool stream_ok = StreamRoundTrip(p.data, options);
+        if (!ok || !stream_ok) failures++;
+
+        double seconds = std::chrono::duration<double>(end - start).count();
+        double ns_per_byte = seconds * 1e9 / p.data.size();
+        if (baseline_ns == 0) baseline_ns = ns_per_byte;
+
+        std::cout << std::left << std::setw(14) << p.name << std::right << std::fixed
+                  << std::setw(12) << std::setprecision(1) << ns_per_byte
+                  << std::setw(12) << std::setprecision(1) << p.data.size() / seconds / 1e6
+                  << std::setw(10) << std::setprecision(2) << (double)p.data.size() / compressed.size()
+                  << std::setw(11) << std::setprecision(2) << ns_per_byte / baseline_ns << "x"
+                  << (ok ? "" : "  ROUND-TRIP FAILED") << (stream_ok ? "" : "  STREAM ROUND-TRIP FAILED") << "\n";
+    }
+    return failures;
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "compressor.h"
+
+// compresses a set of adversarial inputs (long runs, short periods, low-entropy noise...)
+// and reports the time per byte for each. pathological inputs should run at about the same
+// speed as ordinary data. every pattern also goes through CompressContext and DecompressContext in small
+// pieces. returns the number of patterns that failed to round-trip either way.
+int RunAdversarialBench(const CompressOptions& options);
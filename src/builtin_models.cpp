@@ -0,0 +1,123 @@
+#include "builtin_models.h"
+#include "rans.h"
+
+// 12-bit frequencies, in the order of BuiltinModel.
+constexpr uint16_t kBuiltinFreqs[kBuiltinModelCount][256] = {
+    // english text
+    {
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 31, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        119, 1, 5, 2, 1, 1, 1, 2, 8, 7, 3, 1, 12, 28, 42, 53,
+        32, 38, 34, 21, 17, 15, 16, 12, 14, 15, 13, 2, 3, 2, 2, 1,
+        3, 17, 12, 16, 13, 17, 11, 9, 8, 18, 9, 5, 17, 13, 11, 11,
+        11, 1, 17, 23, 15, 8, 5, 6, 1, 3, 1, 4, 1, 3, 1, 133,
+        10, 232, 70, 141, 116, 268, 74, 70, 76, 221, 10, 38, 151, 114, 157, 204,
+        125, 14, 190, 183, 174, 124, 46, 41, 37, 54, 14, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    },
+    // source code
+    {
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 15, 33, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        243, 9, 27, 15, 1, 4, 14, 24, 72, 48, 19, 12, 45, 32, 63, 28,
+        25, 32, 27, 16, 10, 8, 9, 8, 10, 7, 54, 14, 23, 24, 25, 3,
+        6, 29, 12, 29, 17, 34, 15, 11, 8, 34, 1, 4, 18, 15, 24, 22,
+        21, 1, 27, 35, 34, 14, 7, 8, 7, 6, 1, 17, 4, 14, 1, 117,
+        15, 168, 57, 101, 93, 228, 70, 50, 56, 161, 5, 23, 113, 73, 136, 154,
+        87, 8, 147, 156, 155, 97, 30, 42, 30, 46, 7, 14, 7, 15, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    },
+    // json
+    {
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 5, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        124, 1, 29, 2, 2, 1, 2, 5, 5, 4, 4, 18, 14, 56, 45, 40,
+        38, 44, 38, 34, 34, 33, 31, 28, 28, 27, 11, 1, 1, 5, 2, 1,
+        7, 31, 27, 32, 33, 32, 27, 24, 22, 35, 22, 21, 25, 30, 32, 30,
+        31, 21, 32, 42, 36, 29, 26, 26, 21, 21, 22, 3, 13, 4, 4, 9,
+        8, 168, 72, 105, 103, 209, 69, 61, 69, 150, 32, 44, 113, 84, 131, 150,
+        87, 23, 145, 142, 135, 97, 43, 48, 38, 54, 28, 4, 2, 6, 1, 1,
+        2, 2, 2, 2, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 2, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        2, 1, 1, 1, 1, 1, 1, 1, 3, 1, 1, 1, 2, 1, 1, 1,
+        1, 1, 1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        3, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        3, 1, 1, 3, 2, 4, 3, 2, 2, 1, 1, 2, 3, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    },
+    // x86-64 machine code
+    {
+        73, 40, 23, 22, 29, 36, 13, 14, 36, 12, 12, 13, 16, 15, 16, 90,
+        34, 13, 9, 9, 15, 13, 9, 8, 25, 8, 8, 7, 11, 9, 7, 11,
+        36, 8, 8, 8, 49, 10, 7, 7, 22, 20, 7, 9, 11, 13, 10, 9,
+        23, 27, 7, 8, 13, 15, 6, 6, 19, 32, 8, 11, 14, 18, 7, 8,
+        30, 44, 12, 19, 32, 30, 14, 14, 108, 54, 9, 9, 61, 28, 10, 10,
+        24, 7, 9, 15, 17, 15, 10, 10, 16, 7, 7, 11, 12, 11, 7, 12,
+        17, 12, 8, 16, 17, 16, 19, 9, 16, 12, 7, 9, 16, 11, 12, 15,
+        22, 6, 14, 17, 50, 37, 9, 10, 18, 8, 6, 10, 13, 11, 9, 10,
+        24, 13, 8, 45, 46, 46, 9, 9, 16, 97, 5, 75, 10, 58, 8, 7,
+        20, 5, 6, 6, 11, 9, 6, 5, 9, 5, 5, 6, 8, 7, 5, 5,
+        12, 5, 5, 6, 9, 6, 6, 6, 10, 5, 5, 6, 9, 6, 5, 6,
+        12, 6, 6, 6, 10, 8, 14, 7, 14, 9, 13, 7, 10, 11, 13, 9,
+        29, 18, 14, 17, 16, 14, 21, 26, 14, 11, 8, 7, 8, 7, 8, 8,
+        18, 8, 13, 8, 9, 8, 8, 8, 13, 7, 8, 10, 8, 8, 10, 14,
+        17, 8, 9, 8, 11, 8, 10, 11, 118, 66, 10, 29, 13, 12, 12, 17,
+        18, 8, 10, 10, 10, 9, 18, 14, 19, 10, 12, 11, 10, 12, 14, 64,
+    },
+    // utf-16 text
+    {
+        400, 1, 1, 1, 1, 1, 1, 1, 1, 1, 65, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        104, 9, 21, 17, 1, 3, 7, 12, 38, 25, 12, 4, 13, 69, 64, 63,
+        45, 54, 51, 40, 37, 35, 36, 30, 30, 26, 27, 5, 12, 11, 9, 5,
+        3, 37, 22, 34, 24, 28, 25, 14, 14, 28, 8, 8, 21, 25, 20, 22,
+        24, 2, 26, 38, 29, 18, 13, 14, 5, 5, 2, 31, 3, 19, 1, 85,
+        68, 95, 70, 98, 88, 94, 76, 76, 52, 97, 14, 41, 79, 81, 82, 92,
+        84, 16, 91, 114, 95, 71, 43, 57, 40, 57, 18, 8, 3, 8, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+        1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    },
+};
+
+static_assert(sizeof(kBuiltinFreqs) == kBuiltinModelCount * 512, "one 12-bit model per BuiltinModel");
+
+std::vector<uint8_t> BuiltinModelData(BuiltinModel model) {
+    const uint16_t* freqs = kBuiltinFreqs[(int)model - 1];
+    std::vector<uint8_t> out;
+    for (int i = 0; i < 256; ++i) {
+        out.push_back(freqs[i] & 0xFF);
+        out.push_back(freqs[i] >> 8);
+    }
+    return out;
+}
+
+const uint8_t* BuiltinRansTable(BuiltinModel model) {
+    // a static local is only initialised once, even if several threads get here first.
+    static const std::vector<std::vector<uint8_t>> tables = [] {
+        std::vector<std::vector<uint8_t>> built(kBuiltinModelCount);
+        for (int m = 0; m < kBuiltinModelCount; ++m) BuildRansTable(BuiltinModelData((BuiltinModel)(m + 1)), built[m]);
+        return built;
+    }();
+    return tables[(int)model - 1].data();
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include "format.h"
+
+// literal models compiled into the program, one for each common kind of data (see BuiltinModel in format.h).
+// a block can name one in its header instead of storing a model, which for a small block is a good part of
+// its size. they were trained on the literals of 16K blocks of each kind of data, and give every byte
+// at least the smallest probability, so any block can be coded with any of them, if badly.
+
+// the model in the usual 512-byte form (see rans.h). 'model' can't be kNone.
+std::vector<uint8_t> BuiltinModelData(BuiltinModel model);
+
+// its decode table, for RansDecoder::SetTable. the tables are built the first time any of them is asked for
+// and then kept, so blocks that use a built-in model never build one.
+const uint8_t* BuiltinRansTable(BuiltinModel model);
@@ -0,0 +1,157 @@
+#include "compression_cache.h"
+#include "dictionary.h"
+#include "file_io.h"
+#include "format.h"
+#include "hash.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bump this whenever the .mido format changes, so old entries stop matching.
+constexpr int kCacheVersion = 2;
+
+// temporary files older than this were left behind by a process that died mid-write.
+constexpr time_t kStaleTempSeconds = 3600;
+
+static const char kEntrySuffix[] = ".mido";
+static const char kTempPrefix[] = "tmp-";
+
+bool CompressionCache::Open(const std::string& path, uint64_t limit) {
+    dir = path;
+    max_bytes = limit;
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Failed to create cache directory: " << dir << "\n";
+        return false;
+    }
+    return true;
+}
+
+std::string CompressionCache::Key(const std::vector<uint8_t>& data, const CompressOptions& options) const {
+    // a file with checkpoints or a dictionary is never primed, so the prime size only matters without them.
+    int prime_size = options.checkpoint_size > 0 || options.dictionary ? 0 : options.prime_size;
+    char key[128];
+    std::snprintf(key, sizeof(key), "%016llx-%llu-v%d-l%d-b%d-p%d-k%d-d%08x-w%d-j%d",
+                  (unsigned long long)ContentHash(data.data(), data.size()), (unsigned long long)data.size(),
+                  kCacheVersion, options.level, options.block_size, prime_size, options.checkpoint_size,
+                  options.dictionary ? options.dictionary->Id() : 0, options.text ? 1 : 0, options.json ? 1 : 0);
+    return key;
+}
+
+bool CompressionCache::Lookup(const std::string& key, uint64_t orig_size, std::vector<uint8_t>& compressed) {
+    std::string path = dir + "/" + key + kEntrySuffix;
+    InputFile in;
+    compressed.clear();
+    if (!in.Open(path) || !in.ReadAll(compressed)) return false;
+
+    // entries are renamed into place whole, so this only catches a damaged disk or a stray file.
+    FrameHeader frame;
+    if (compressed.size() < kFrameHeaderSize || !ReadFrameHeader(compressed.data(), frame) ||
+        frame.orig_size != orig_size) {
+        return false;
+    }
+    // the modification time doubles as the last use, which is what eviction goes by.
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return true;
+}
+
+void CompressionCache::Store(const std::string& key, const std::vector<uint8_t>& compressed) {
+    // the temporary name is unique to this process and call (the counter is atomic, so threads storing
+    // at once get different names), and rename replaces any entry another process stored for the same key
+    // in the meantime (which holds the same data).
+    static std::atomic<int> counter{0};
+    char temp_name[64];
+    std::snprintf(temp_name, sizeof(temp_name), "%s%d-%d", kTempPrefix, (int)getpid(), counter++);
+    std::string temp = dir + "/" + temp_name;
+    OutputFile out;
+    if (!out.Open(temp)) return;
+    bool ok = out.Write(compressed.data(), compressed.size());
+    ok = out.Close() && ok;
+    if (!ok || std::rename(temp.c_str(), (dir + "/" + key + kEntrySuffix).c_str()) != 0) {
+        unlink(temp.c_str());
+        return;
+    }
+    if (max_bytes > 0) Account(compressed.size());
+}
+
+void CompressionCache::Account(uint64_t added) {
+    // the total is kept as text in the lock file, so every store is a small read and write under the lock
+    // rather than a walk over the whole directory. it can drift (an entry replaced under the same key counts
+    // twice, a file deleted by hand still counts), but only upward, and the scan that follows puts it right.
+    std::string lock_path = dir + "/lock";
+    int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0) return;
+    if (flock(lock_fd, LOCK_EX) != 0) {
+        close(lock_fd);
+        return;
+    }
+
+    char text[32] = {};
+    ssize_t got = pread(lock_fd, text, sizeof(text) - 1, 0);
+    char* end = nullptr;
+    uint64_t total = got > 0 ? std::strtoull(text, &end, 10) : 0;
+    // an empty lock file (a new cache, or one from before the total was kept) means the total is unknown.
+    bool known = got > 0 && end != text;
+    total += added;
+    if (!known || total > max_bytes) total = Evict();
+
+    // fixed width, so a shorter total never leaves digits of the old one behind.
+    int len = std::snprintf(text, sizeof(text), "%020llu\n", (unsigned long long)total);
+    if (pwrite(lock_fd, text, len, 0) != len) {
+        // a partly written total could read back too low. an empty file makes the next store scan instead,
+        // and if even that fails there's nothing more to do: the entry itself is in place.
+        int cleared = ftruncate(lock_fd, 0);
+        (void)cleared;
+    }
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+uint64_t CompressionCache::Evict() {
+    struct Entry {
+        std::string path;
+        uint64_t size;
+        struct timespec used;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    time_t now = time(nullptr);
+    if (DIR* d = opendir(dir.c_str())) {
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            std::string path = dir + "/" + name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (name.compare(0, sizeof(kTempPrefix) - 1, kTempPrefix) == 0) {
+                if (now - st.st_mtime > kStaleTempSeconds) unlink(path.c_str());
+                continue;
+            }
+            size_t suffix = sizeof(kEntrySuffix) - 1;
+            if (name.size() <= suffix || name.compare(name.size() - suffix, suffix, kEntrySuffix) != 0) continue;
+            entries.push_back({path, (uint64_t)st.st_size, st.st_mtim});
+            total += st.st_size;
+        }
+        closedir(d);
+    }
+
+    if (total > max_bytes) {
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+        });
+        // a process that has an entry open keeps reading it fine after the unlink.
+        for (const Entry& e : entries) {
+            if (total <= max_bytes) break;
+            if (unlink(e.path.c_str()) == 0 || errno == ENOENT) total -= e.size;
+        }
+    }
+    return total;
+}
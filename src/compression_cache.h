@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "compressor.h"
+
+// an on-disk cache of compressed outputs, so compressing the same bytes with the same options again
+// just reads the earlier result back. entries are keyed by a 64-bit hash of the input, its size and
+// every option that changes the output, the dictionary included (threads don't: any thread count gives
+// an equivalent file).
+//
+// any number of processes can share a cache directory. entries are written to a temporary file and
+// renamed into place, so a reader sees a whole entry or none. a lock file holds a running total of the
+// entry sizes, so a store only looks at the directory once the total passes the limit.
+// reading an entry marks it as recently used; once the entries add up to more than the limit,
+// the least recently used ones are deleted.
+class CompressionCache {
+public:
+    // creates 'dir' if it doesn't exist. 'max_bytes' = 0 means no limit.
+    bool Open(const std::string& dir, uint64_t max_bytes);
+
+    // the name of the entry for compressing 'data' with 'options'.
+    std::string Key(const std::vector<uint8_t>& data, const CompressOptions& options) const;
+    // reads the entry into 'compressed'. false if there's no usable entry for the key.
+    bool Lookup(const std::string& key, uint64_t orig_size, std::vector<uint8_t>& compressed);
+    // adds an entry, then evicts old ones if the cache has grown past its limit. failures only cost a miss later.
+    void Store(const std::string& key, const std::vector<uint8_t>& compressed);
+
+private:
+    std::string dir;
+    uint64_t max_bytes = 0;
+
+    // adds 'added' bytes to the running total and evicts if it's past the limit.
+    void Account(uint64_t added);
+    // scans the directory and deletes entries until they fit. the caller holds the lock.
+    // returns what's left.
+    uint64_t Evict();
+};
@@ -1,97 +1,324 @@
 #include "compressor.h"
+#include "stream_decoder.h"
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include "suffix_array.h"
 #include "rans.h"
 #include "bitstream.h"
+#include "match_finder.h"
+#include "file_io.h"
+#include "format.h"
+#include "compression_cache.h"
+#include "dictionary.h"
+#include "builtin_models.h"
+#include "text_transform.h"
+#include "json_transform.h"
 
 #include <chrono>
 #include <cmath>
 #include <iomanip>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
 
 // ... (includes)
 
-struct Match {
-    int distance;
-    int length;
+// the token stream produced by the lz77 parse.
+// when a block is split into chunks, every chunk produces one of these and we stitch them together afterwards.
+struct ParsedTokens {
+    std::vector<uint8_t> literals;
+    std::vector<Match> matches;
+    std::vector<bool> is_match;
 };
 
-Match FindLongestMatch(const std::vector<uint8_t>& data, int pos, int window_size) {
-    int max_len = 0;
-    int best_dist = 0;
-    // we limit match length to 255 to fit in a single byte
-    int limit = std::min((int)data.size(), pos + 255);
-    int start_search = std::max(0, pos - window_size);
+// how far back a match can reach. has to be a power of two for the match finder's chain table.
+constexpr int kWindowSize = 32768;
 
-    for (int i = start_search; i < pos; ++i) {
-        int len = 0;
-        while (pos + len < limit && i + len < pos && data[i + len] == data[pos + len]) {
-            len++;
-        }
-        if (len > max_len) {
-            max_len = len;
-            best_dist = pos - i;
-        }
-    }
-    
-    if (max_len < 3) return {0, 0};
-    return {best_dist, max_len};
+// runs of a single byte at least this long skip the match finder and become one run token.
+// the decoder expands them with a memset instead of a byte-by-byte copy.
+constexpr int kMinRunLength = 32;
+
+// chunks smaller than this aren't worth a thread of their own.
+constexpr int kMinParallelChunk = 64 * 1024;
+
+// splitting a block's literals costs at least this many bytes for every extra model and stream, so it's only
+// tried if the streams' statistics save more than that.
+constexpr double kMinSplitGain = 128;
+
+// the most streams a block's literals are split into (see LiteralSplit).
+constexpr int kMaxLiteralStreams = 3;
+
+static int LiteralStreams(LiteralSplit split) {
+    return split == LiteralSplit::kUtf8 ? 3 : split == LiteralSplit::kAfterMatch ? 2 : 1;
 }
 
-void Compress(const std::string& input_path, const std::string& output_path) {
-    auto start_time = std::chrono::high_resolution_clock::now();
+// which stream the literal at 'p' goes in when a block splits its literals by utf-8 (LiteralSplit::kUtf8):
+// 0 after ascii (or anything that isn't utf-8), 1 after a whole multi-byte character, 2 inside one.
+// only the 'before' bytes in front of 'p' that belong to the block are looked at, so it comes out the same
+// however the block is decoded.
+static inline int Utf8Stream(const uint8_t* p, size_t before) {
+    uint8_t b1 = before > 0 ? p[-1] : 0;
+    if (b1 < 0x80) return 0;
+    if (b1 >= 0xC0) return 2;
+    // after a continuation byte, the character goes on if it's the second of a 3- or 4-byte one,
+    // or the third of a 4-byte one.
+    uint8_t b2 = before > 1 ? p[-2] : 0;
+    uint8_t b3 = before > 2 ? p[-3] : 0;
+    return b2 >= 0xE0 || (b2 >= 0x80 && b2 < 0xC0 && b3 >= 0xF0) ? 2 : 1;
+}
 
-    std::ifstream in(input_path, std::ios::binary);
-    if (!in) {
-        std::cerr << "Failed to open input file: " << input_path << "\n";
-        return;
-    }
-    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
-    in.close();
+// DecompressBuffer reserves at most this many output bytes per input byte before it has seen the blocks.
+constexpr size_t kMaxReserveRatio = 16;
 
-    if (data.empty()) return;
+// a built-in literal model saves at most the 512 bytes of the block's own, which more literals than this
+// always lose again to the built-in model fitting them worse.
+constexpr size_t kMaxBuiltinModelLiterals = 64 * 1024;
 
-    std::cout << "Input size: " << data.size() << " bytes\n";
+// the literals of a block are entropy coded in segments of about this many bytes, each flushed on its own,
+// so both sides can spread one big block's literals over several threads.
+// every segment costs 12 bytes (its final state plus its entry in the segment table).
+constexpr size_t kLiteralSegmentSize = 256 * 1024;
 
-    // step 1: modeling
-    // we need to understand the data before we compress it.
-    // we build a frequency table (histogram) of all the bytes in the file.
-    // this tells the rans encoder which bytes are common (cheap to encode) and which are rare (expensive).
-    RansEncoder rans;
-    rans.Init();
-    rans.BuildModel(data);
+// parses data[begin, end) into tokens.
+// everything in [history_begin, begin) is read-only history, so matches can reach back into earlier chunks
+// while another thread is still parsing them. the bytes never change, only the tokens do.
+// with a 'dictionary', the history is its content, which data starts with.
+void ParseRange(const std::vector<uint8_t>& data, int begin, int end, int history_begin, int window_size,
+                const MatchParams& params, const Dictionary* dictionary, ParsedTokens& out) {
+    // every chunk gets its own hash chains, primed with the window of history just before it.
+    // a dictionary comes with them ready-made.
+    MatchFinder finder = dictionary ? MatchFinder(data, history_begin, window_size, params, dictionary->Head(),
+                                                  dictionary->Prev(), dictionary->Size())
+                                    : MatchFinder(data, history_begin, window_size, params);
+    if (!dictionary) finder.Insert(std::max(history_begin, begin - window_size), begin);
 
-    std::vector<uint8_t> literals;
-    std::vector<Match> matches;
-    std::vector<bool> is_match;
+    int pos = begin;
+    while (pos < end) {
+        // fast path: if this byte repeats the one before it, measure the run before doing any real searching.
+        // zero-filled and padded regions go through here without touching the hash chains.
+        if (pos > history_begin && data[pos] == data[pos - 1]) {
+            int run = RunLength(data.data() + pos, end - pos, data[pos]);
+            if (run >= kMinRunLength) {
+                // a run is a match with distance 0: "repeat the previous byte 'run' times".
+                out.matches.push_back({0, run});
+                out.is_match.push_back(true);
+                finder.Skip(pos, run);
+                pos += run;
+                continue;
+            }
+        }
 
-    // step 2: parsing (lz77)
-    // we walk through the file and look for patterns we've seen before.
-    // this is the "middle-out" part where we exploit the structure of the data.
-    int pos = 0;
-    while (pos < data.size()) {
         // we look backwards to see if the string starting at 'pos' appeared earlier.
-        Match m = FindLongestMatch(data, pos, 32768);
+        Match m = finder.FindLongestMatch(pos, end);
         
         if (m.length >= 3) {
             // if we found a match of length 3 or more, it's worth compressing.
             // instead of writing the bytes, we write a "reference" to the previous occurrence.
-            matches.push_back(m);
-            is_match.push_back(true);
+            out.matches.push_back(m);
+            out.is_match.push_back(true);
+            finder.Skip(pos, m.length);
             pos += m.length;
         } else {
             // if no match found, we just keep the literal byte.
-            literals.push_back(data[pos]);
-            is_match.push_back(false);
+            out.literals.push_back(data[pos]);
+            out.is_match.push_back(false);
             pos++;
         }
     }
+}
+
+// a piece of a block that is parsed on its own. its matches can reach back as far as history_begin.
+struct ParseChunk {
+    int begin;
+    int end;
+    int history_begin;
+    // set for the chunk that starts right after a dictionary.
+    const Dictionary* dictionary = nullptr;
+};
+
+// how much of each token stream comes before a chunk once the chunks are stitched together.
+struct ChunkStart {
+    size_t tokens = 0;
+    size_t literals = 0;
+    size_t matches = 0;
+};
+
+// parses the chunks on up to 'threads' threads. normally every chunk sees the whole block before it
+// as history, so the ratio stays close to a serial parse; the only loss is that a match can't cross
+// a chunk boundary. if 'starts' is set it gets one entry per chunk.
+ParsedTokens ParseChunks(const std::vector<uint8_t>& data, const std::vector<ParseChunk>& chunks, int window_size,
+                         const MatchParams& params, int threads, std::vector<ChunkStart>* starts) {
+    std::vector<ParsedTokens> parsed(chunks.size());
+    std::atomic<size_t> next_chunk(0);
+    auto worker = [&]() {
+        for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++) {
+            ParseRange(data, chunks[c].begin, chunks[c].end, chunks[c].history_begin, window_size, params,
+                       chunks[c].dictionary, parsed[c]);
+        }
+    };
+    // the calling thread takes chunks too instead of sitting idle.
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads && (size_t)t < chunks.size(); ++t) workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers) w.join();
+
+    // stitch the chunk streams together in order. the decoder can't tell the difference,
+    // it just sees one token stream for the whole block.
+    ParsedTokens result;
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        if (starts) starts->push_back({result.is_match.size(), result.literals.size(), result.matches.size()});
+        result.literals.insert(result.literals.end(), parsed[c].literals.begin(), parsed[c].literals.end());
+        result.matches.insert(result.matches.end(), parsed[c].matches.begin(), parsed[c].matches.end());
+        result.is_match.insert(result.is_match.end(), parsed[c].is_match.begin(), parsed[c].is_match.end());
+    }
+    return result;
+}
+
+// one block after entropy coding. blocks are self-contained apart from the primed history,
+// so they can be produced on any thread and written out in order afterwards.
+struct EncodedBlock {
+    BlockHeader header;
+    uint32_t offset = 0; // where the block's raw bytes start in the input
+    std::vector<uint8_t> rans_out;
+    std::vector<uint8_t> flags;
+    std::vector<uint8_t> matches;
+    std::vector<uint8_t> model;
+    std::vector<uint8_t> checkpoints;
+};
+
+// fits a model (or models) to 'symbols' alone, for a stream that carries its own.
+static void BuildOwnModel(RansEncoder& rans, const std::vector<uint8_t>& symbols) {
+    rans.BuildModel(symbols);
+    rans.BuildModels(symbols);
+}
+
+// codes 'symbols' with rans's model and takes the model along: [model size] [model] then a segmented rans stream.
+// that's how coded flags and the literals after matches are stored.
+static std::vector<uint8_t> EncodeWithModel(const RansEncoder& rans, const std::vector<uint8_t>& symbols,
+                                            int threads) {
+    std::vector<uint8_t> model = rans.GetModelData();
+    std::vector<uint8_t> out;
+    PutU32(out, model.size());
+    out.insert(out.end(), model.begin(), model.end());
+    std::vector<uint8_t> stream = rans.EncodeSegmented(symbols, kLiteralSegmentSize, threads);
+    out.insert(out.end(), stream.begin(), stream.end());
+    return out;
+}
+
+// what the symbols counted in 'counts' take with an ideal order-0 model of their own, in bytes,
+// the model not included.
+static double EntropyBytes(const uint64_t counts[256]) {
+    uint64_t total = 0;
+    for (int c = 0; c < 256; ++c) total += counts[c];
+    double bits = 0;
+    for (int c = 0; c < 256; ++c) {
+        if (counts[c]) bits -= counts[c] * std::log2((double)counts[c] / total);
+    }
+    return bits / 8;
+}
+
+// calls f(pos, follows_match) for every literal of the block that starts at 'begin', in order: 'pos' is where
+// the literal is in the data, and 'follows_match' says whether the token before it was a match or run.
+template <typename F>
+static void ForEachLiteral(const ParsedTokens& tokens, size_t begin, F f) {
+    size_t next_match = 0;
+    size_t pos = begin;
+    bool follows_match = false;
+    for (bool is_match : tokens.is_match) {
+        if (is_match) {
+            pos += tokens.matches[next_match++].length;
+        } else {
+            f(pos++, follows_match);
+        }
+        follows_match = is_match;
+    }
+}
 
-    std::cout << "LZ77: " << matches.size() << " matches, " << literals.size() << " literals.\n";
+// compresses data[begin, end) as one block. matches may reach back to 'history_begin',
+// which is either the block start or the primed tail of the previous block.
+// with a checkpoint_size, the block is cut into intervals that don't reference each other,
+// and a checkpoint is stored at the start of every one but the first.
+// with a 'dictionary', data[0, begin) is its content and the history of the block's first interval.
+// with 'text' or 'json', a block that takes to one of those transforms goes through it first.
+EncodedBlock CompressBlock(const std::vector<uint8_t>& data, int begin, int end, int history_begin,
+                           const MatchParams& params, int threads, int checkpoint_size,
+                           const Dictionary* dictionary, bool text, bool json) {
+    // the transformed block is parsed behind the same history as the block itself would be,
+    // so both sides still see the original bytes of whatever came before it.
+    // checkpoints count positions in the untransformed block, which rules the transforms out.
+    // json records are text too, so the json transform gets the first go.
+    std::vector<uint8_t> transformed;
+    BlockTransform transform = BlockTransform::kNone;
+    if (checkpoint_size == 0) {
+        if (json && JsonTransform(data.data() + begin, end - begin, transformed)) {
+            transform = BlockTransform::kJson;
+        } else if (text && WordTransform(data.data() + begin, end - begin, transformed)) {
+            transform = BlockTransform::kWords;
+        }
+    }
+    if (transform != BlockTransform::kNone) {
+        std::vector<uint8_t> window(data.begin() + history_begin, data.begin() + begin);
+        window.insert(window.end(), transformed.begin(), transformed.end());
+        EncodedBlock block = CompressBlock(window, begin - history_begin, window.size(), 0, params, threads, 0,
+                                           dictionary, false, false);
+        // repetitive text can do better without the word transform, so that block is compressed both ways
+        // and the smaller one is kept. json blocks came out well ahead every time, even when the records
+        // were near copies of each other, so they're spared the second parse.
+        if (block.header.stored || transform == BlockTransform::kWords) {
+            EncodedBlock plain =
+                CompressBlock(data, begin, end, history_begin, params, threads, 0, dictionary, false, false);
+            if (block.header.stored || kTransformedHeaderSize + block.header.PayloadSize() >=
+                                           plain.header.HeaderSize() + plain.header.PayloadSize()) {
+                return plain;
+            }
+        }
+        block.offset = begin;
+        block.header.raw_size = end - begin;
+        block.header.transform = transform;
+        block.header.transformed_size = transformed.size();
+        return block;
+    }
+
+    EncodedBlock block;
+    block.header.raw_size = end - begin;
+    block.offset = begin;
+
+    // step 1: modeling
+    // we need to understand the data before we compress it.
+    // we build a frequency table (histogram) of all the bytes in the block.
+    // this tells the rans encoder which bytes are common (cheap to encode) and which are rare (expensive).
+    // the table is stored with the block, so there's nothing to gain from counting the primed history too.
+    RansEncoder rans;
+    rans.BuildModel(std::vector<uint8_t>(data.begin() + begin, data.begin() + end));
+
+    // step 2: parsing (lz77)
+    // we walk through the block and look for patterns we've seen before.
+    // this is the "middle-out" part where we exploit the structure of the data.
+    // with more than one thread the block is cut into chunks that are parsed side by side.
+    std::vector<ParseChunk> chunks;
+    if (checkpoint_size > 0) {
+        for (int b = begin; b < end; b = end - b > checkpoint_size ? b + checkpoint_size : end) {
+            chunks.push_back({b, end - b > checkpoint_size ? b + checkpoint_size : end, b == begin ? history_begin : b,
+                              b == begin ? dictionary : nullptr});
+        }
+    } else {
+        int n = end - begin;
+        int num_chunks = std::max(1, std::min(threads, n / kMinParallelChunk));
+        for (int c = 0; c < num_chunks; ++c) {
+            chunks.push_back({begin + (int)((int64_t)n * c / num_chunks),
+                              begin + (int)((int64_t)n * (c + 1) / num_chunks), history_begin,
+                              c == 0 ? dictionary : nullptr});
+        }
+    }
+    std::vector<ChunkStart> starts;
+    ParsedTokens tokens = ParseChunks(data, chunks, kWindowSize, params, threads, &starts);
+    const std::vector<uint8_t>& literals = tokens.literals;
+    const std::vector<Match>& matches = tokens.matches;
+    const std::vector<bool>& is_match = tokens.is_match;
 
     BitWriter flags_out;
-    std::vector<uint8_t> packed_matches;
     
     // step 3: encoding
     // we now have three streams of information:
@@ -103,61 +330,386 @@ void Compress(const std::string& input_path, const std::string& output_path) {
     for (bool flag : is_match) {
         flags_out.WriteBit(flag);
     }
-    
+    flags_out.Flush();
+
+    // every interval after the first gets a checkpoint. the parse counted matches, but the decoder
+    // needs byte offsets, so those are filled in while the matches are packed.
+    std::vector<Checkpoint> checkpoints;
+    std::vector<size_t> literal_marks;
+    if (checkpoint_size > 0) {
+        for (size_t c = 1; c < chunks.size(); ++c) {
+            Checkpoint cp;
+            cp.raw_pos = chunks[c].begin - begin;
+            cp.flag_index = starts[c].tokens;
+            cp.literal_index = starts[c].literals;
+            checkpoints.push_back(cp);
+            literal_marks.push_back(starts[c].literals);
+        }
+    }
+
+    // the flags are also coded like the literals, packed eight to a byte so that every symbol is a little
+    // context of its own. the model (or models, see rans.h) catch how runs of literals and matches alternate,
+    // and decoding them costs one symbol per eight tokens, ahead of the token loop, which doesn't change.
+    // data that doesn't repeat much is nearly all literals, and then the raw bits do as well.
+    RansEncoder flag_rans;
+    BuildOwnModel(flag_rans, flags_out.GetData());
+    std::vector<uint8_t> coded_flags = EncodeWithModel(flag_rans, flags_out.GetData(), threads);
+    if (coded_flags.size() < flags_out.GetData().size()) {
+        block.flags = std::move(coded_flags);
+        block.header.coded_flags = true;
+    } else {
+        block.flags = flags_out.GetData();
+    }
+    size_t next_checkpoint = 0;
+    auto mark_matches = [&](size_t match_index) {
+        while (next_checkpoint < checkpoints.size() && starts[next_checkpoint + 1].matches == match_index) {
+            checkpoints[next_checkpoint++].match_offset = block.matches.size();
+        }
+    };
+
     // next, we pack the matches.
     // we store distance and length simply. in a pro version, we'd compress these too.
-    for (const auto& m : matches) {
-        packed_matches.push_back(m.distance & 0xFF);
-        packed_matches.push_back((m.distance >> 8) & 0xFF);
-        packed_matches.push_back(m.length & 0xFF);
+    // runs can be far longer than 255, so they get a zero distance followed by a varint length.
+    for (size_t i = 0; i < matches.size(); ++i) {
+        const Match& m = matches[i];
+        mark_matches(i);
+        block.matches.push_back(m.distance & 0xFF);
+        block.matches.push_back((m.distance >> 8) & 0xFF);
+        if (m.distance != 0) {
+            block.matches.push_back(m.length & 0xFF);
+        } else {
+            uint32_t len = m.length;
+            while (len >= 0x80) {
+                block.matches.push_back((len & 0x7F) | 0x80);
+                len >>= 7;
+            }
+            block.matches.push_back(len);
+        }
     }
-    
-    // finally, we encode the literals using rans.
-    // rans is a "stack-based" entropy coder, meaning it's last-in-first-out (lifo).
-    // to make sure the decoder reads the first literal first, we must encode them in reverse order (last literal first).
-    for (int i = literals.size() - 1; i >= 0; --i) {
-        rans.Encode(literals[i]);
+    mark_matches(matches.size());
+
+    // the block's statistics are an average, which a block that mixes different kinds of data can do better than.
+    std::vector<uint8_t> block_model = rans.GetModelData();
+    rans.BuildModels(literals);
+
+    // some literals have statistics of their own, and can go in streams of their own (see LiteralSplit) if
+    // the extra models pay for themselves. the literal right after a match is where a copy stopped: the byte that
+    // would have continued the match almost never is, and in text it's often the first letter of a new word.
+    // in utf-8 text, where a byte falls in a character says a lot about it: inside one it's a continuation byte,
+    // after a whole multi-byte one it's likely the lead byte of the next, and after ascii likely ascii again.
+    // checkpoints count literals in a single stream, so blocks with them keep one.
+    // building the models is slow next to a histogram, so a split has to look promising first.
+    const std::vector<uint8_t>* coded = &literals;
+    std::vector<uint8_t> streams[kMaxLiteralStreams];
+    RansEncoder side_rans[kMaxLiteralStreams];
+    uint64_t all_counts[256] = {}, after_counts[256] = {}, utf8_counts[kMaxLiteralStreams][256] = {};
+    if (checkpoint_size == 0) {
+        ForEachLiteral(tokens, begin, [&](size_t pos, bool follows_match) {
+            uint8_t c = data[pos];
+            all_counts[c]++;
+            after_counts[c] += follows_match;
+            utf8_counts[Utf8Stream(&data[pos], pos - begin)][c]++;
+        });
+    }
+    uint64_t rest_counts[256];
+    for (int c = 0; c < 256; ++c) rest_counts[c] = all_counts[c] - after_counts[c];
+    double all_bytes = EntropyBytes(all_counts);
+    double after_gain = all_bytes - EntropyBytes(rest_counts) - EntropyBytes(after_counts) - kMinSplitGain;
+    double utf8_gain = all_bytes - 2 * kMinSplitGain;
+    for (const uint64_t* counts : utf8_counts) utf8_gain -= EntropyBytes(counts);
+    LiteralSplit split = after_gain > std::max(utf8_gain, 0.0) ? LiteralSplit::kAfterMatch
+                         : utf8_gain > 0                      ? LiteralSplit::kUtf8
+                                                              : LiteralSplit::kNone;
+    if (split != LiteralSplit::kNone) {
+        int num_streams = LiteralStreams(split);
+        ForEachLiteral(tokens, begin, [&](size_t pos, bool follows_match) {
+            int s = split == LiteralSplit::kAfterMatch ? follows_match : Utf8Stream(&data[pos], pos - begin);
+            streams[s].push_back(data[pos]);
+        });
+        side_rans[0].SetModel(block_model);
+        side_rans[0].BuildModels(streams[0]);
+        // the split also costs the size of the main stream, and every other stream's model and segment table.
+        size_t split_cost = 0;
+        for (int s = 0; s < num_streams; ++s) {
+            if (s > 0) BuildOwnModel(side_rans[s], streams[s]);
+            split_cost += side_rans[s].Cost(streams[s]) + side_rans[s].GetModelData().size() + (s > 0 ? 16 : 0);
+        }
+        if (split_cost < rans.Cost(literals) + rans.GetModelData().size()) {
+            rans.SetModel(side_rans[0].GetModelData());
+            coded = &streams[0];
+            block.header.literal_split = split;
+        }
     }
 
-    flags_out.Flush();
-    rans.Flush();
+    // a dictionary's literal model can be used instead of the block's own, which then isn't stored, and so can
+    // a built-in one. for a small block that's most of its size, so we take whichever codes the literals in the
+    // fewest bytes, the block's own model included. a big block's own model always wins, so it doesn't try them.
+    bool shared_model = false;
+    size_t best_cost = rans.Cost(*coded) + rans.GetModelData().size();
+    std::vector<uint8_t> best_model;
+    auto try_shared = [&](const std::vector<uint8_t>& model, BuiltinModel builtin) {
+        RansEncoder shared;
+        shared.SetModel(model);
+        size_t cost = shared.Cost(*coded);
+        if (cost != SIZE_MAX && cost < best_cost) {
+            best_cost = cost;
+            best_model = model;
+            block.header.builtin_model = builtin;
+            shared_model = true;
+        }
+    };
+    if (dictionary) try_shared(dictionary->Model(), BuiltinModel::kNone);
+    if (coded->size() <= kMaxBuiltinModelLiterals) {
+        for (int m = 1; m <= kBuiltinModelCount; ++m) try_shared(BuiltinModelData((BuiltinModel)m), (BuiltinModel)m);
+    }
+    if (shared_model) rans.SetModel(best_model);
+
+    // finally, we encode the literals using rans.
+    // a big block's literals are cut into segments that are encoded side by side (see rans.h).
+    // the encoder also hands back its state at every checkpoint.
+    std::vector<RansCheckpoint> rans_checkpoints;
+    block.rans_out = rans.EncodeSegmented(*coded, kLiteralSegmentSize, threads, literal_marks, &rans_checkpoints);
+    if (block.header.literal_split != LiteralSplit::kNone) {
+        int num_streams = LiteralStreams(block.header.literal_split);
+        std::vector<uint8_t> split;
+        PutU32(split, block.rans_out.size());
+        split.insert(split.end(), block.rans_out.begin(), block.rans_out.end());
+        for (int s = 1; s < num_streams; ++s) {
+            std::vector<uint8_t> side = EncodeWithModel(side_rans[s], streams[s], threads);
+            if (s + 1 < num_streams) PutU32(split, side.size());
+            split.insert(split.end(), side.begin(), side.end());
+        }
+        block.rans_out = std::move(split);
+    }
+    for (size_t c = 0; c < checkpoints.size(); ++c) {
+        checkpoints[c].rans_state = rans_checkpoints[c].state;
+        checkpoints[c].rans_offset = rans_checkpoints[c].offset;
+    }
+    WriteCheckpoints(block.checkpoints, checkpoints);
 
     // we get the compressed bitstreams.
-    std::vector<uint8_t> rans_out = rans.GetOutput();
-    std::vector<uint8_t> model_data = rans.GetModelData();
+    if (!shared_model) block.model = rans.GetModelData();
+    block.header.rans_size = block.rans_out.size();
+    block.header.flags_size = block.flags.size();
+    block.header.match_size = block.matches.size();
+    block.header.model_size = block.model.size();
+    block.header.checkpoints_size = block.checkpoints.size();
+
+    // if all that effort didn't pay off, keep the raw bytes instead. they can then be passed through
+    // without any decoding, and on the file path without even passing through our buffers.
+    if (kBlockHeaderSize + block.header.PayloadSize() >= kStoredHeaderSize + block.header.raw_size) {
+        block.header.stored = true;
+        block.rans_out.clear();
+        block.flags.clear();
+        block.matches.clear();
+        block.model.clear();
+        block.checkpoints.clear();
+    }
+    return block;
+}
+
+// serialises everything about a block except the raw bytes of a stored block, which the caller copies itself.
+static void AppendBlock(std::vector<uint8_t>& out, const EncodedBlock& block) {
+    WriteBlockHeader(out, block.header);
+    out.insert(out.end(), block.rans_out.begin(), block.rans_out.end());
+    out.insert(out.end(), block.flags.begin(), block.flags.end());
+    out.insert(out.end(), block.matches.begin(), block.matches.end());
+    out.insert(out.end(), block.model.begin(), block.model.end());
+    out.insert(out.end(), block.checkpoints.begin(), block.checkpoints.end());
+}
+
+// checkpoints need every interval to stand on its own, which rules out priming.
+// so does a dictionary, which takes the place of the primed history.
+static FrameHeader MakeFrameHeader(size_t orig_size, size_t num_blocks, const CompressOptions& options) {
+    FrameHeader frame;
+    frame.orig_size = orig_size;
+    frame.prime_size = options.checkpoint_size > 0 || options.dictionary ? 0 : options.prime_size;
+    frame.num_blocks = num_blocks;
+    frame.dict_id = options.dictionary ? options.dictionary->Id() : 0;
+    return frame;
+}
+
+// the dictionary a frame was compressed with, which has to be the one the caller gave us.
+// returns false if it isn't; 'used' is null for a frame without one.
+static bool FrameDictionary(const FrameHeader& frame, const Dictionary* given, const Dictionary*& used) {
+    used = nullptr;
+    if (frame.dict_id == 0) return true;
+    if (!given || given->Id() != frame.dict_id) {
+        std::cerr << (given ? "Wrong dictionary\n" : "Compressed with a dictionary, which wasn't given\n");
+        return false;
+    }
+    used = given;
+    return true;
+}
+
+// true if the caller has asked us to stop. a null token is never set.
+static bool Cancelled(const std::atomic<bool>* cancel) {
+    return cancel && cancel->load(std::memory_order_relaxed);
+}
+
+// compresses all of 'data' into 'blocks'. returns false if it was cancelled.
+static bool CompressBlocks(const std::vector<uint8_t>& data, const CompressOptions& options,
+                           std::vector<EncodedBlock>& blocks) {
+    // blocks are compressed independently. without a block size the whole input is one block.
+    int n = data.size();
+    int block_size = std::min<int>(options.block_size > 0 ? options.block_size : std::max(n, 1), kMaxBlockSize);
+    int num_blocks = (n + block_size - 1) / block_size;
+    MatchParams params = GetMatchParams(options.level);
+    int prime_size = MakeFrameHeader(n, 0, options).prime_size;
+
+    // when there are enough blocks, every thread takes whole blocks.
+    // otherwise the spare threads go into parsing each block in chunks.
+    int block_workers = std::max(1, std::min(options.threads, num_blocks));
+    int threads_per_block = std::max(1, options.threads / block_workers);
+
+    blocks.resize(num_blocks);
+    std::atomic<int> next_block(0);
+    std::atomic<bool> cancelled(false);
+    std::mutex progress_mutex;
+    uint64_t done = 0;
+    auto worker = [&]() {
+        for (int b = next_block++; b < num_blocks; b = next_block++) {
+            if (Cancelled(options.cancel)) {
+                cancelled = true;
+                return;
+            }
+            int begin = b * block_size;
+            int end = std::min(n, begin + block_size);
+            // priming: the block may reference the last prime_size raw bytes of the previous block.
+            // they're already in memory, so no block has to wait for another one to finish.
+            int history_begin = std::max(0, begin - prime_size);
+            if (options.dictionary) {
+                // with a dictionary, it goes right in front of the block instead, where its saved chains expect it.
+                const Dictionary& dictionary = *options.dictionary;
+                std::vector<uint8_t> window(dictionary.Content(), dictionary.Content() + dictionary.Size());
+                window.insert(window.end(), data.begin() + begin, data.begin() + end);
+                blocks[b] = CompressBlock(window, dictionary.Size(), window.size(), 0, params, threads_per_block,
+                                          options.checkpoint_size, &dictionary, options.text, options.json);
+                blocks[b].offset = begin;
+            } else {
+                blocks[b] = CompressBlock(data, begin, end, history_begin, params, threads_per_block,
+                                          options.checkpoint_size, nullptr, options.text, options.json);
+            }
+            if (options.progress) {
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                done += end - begin;
+                options.progress(done, n);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < block_workers; ++t) workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers) w.join();
+
+    return !cancelled;
+}
+
+std::vector<uint8_t> CompressBuffer(const std::vector<uint8_t>& data, const CompressOptions& options) {
+    std::string key;
+    if (options.cache) {
+        std::vector<uint8_t> cached;
+        key = options.cache->Key(data, options);
+        if (options.cache->Lookup(key, data.size(), cached)) {
+            if (options.progress) options.progress(data.size(), data.size());
+            return cached;
+        }
+    }
+
+    std::vector<EncodedBlock> blocks;
+    if (!CompressBlocks(data, options, blocks)) return {};
 
     // step 4: file format
-    // we package everything into a single file with a header.
-    // header: [magic] [sizes...]
-    // body: [rans_data] [flags] [matches] [model]
-    std::ofstream out(output_path, std::ios::binary);
-    
-    uint32_t magic = 0x4D49444F; // "MIDO"
-    uint32_t orig_size = data.size();
-    uint32_t rans_size = rans_out.size();
-    uint32_t flags_size = flags_out.GetData().size();
-    uint32_t match_size = packed_matches.size();
-    uint32_t model_size = model_data.size();
-
-    out.write((char*)&magic, 4);
-    out.write((char*)&orig_size, 4);
-    out.write((char*)&rans_size, 4);
-    out.write((char*)&flags_size, 4);
-    out.write((char*)&match_size, 4);
-    out.write((char*)&model_size, 4);
-
-    out.write((char*)rans_out.data(), rans_size);
-    out.write((char*)flags_out.GetData().data(), flags_size);
-    out.write((char*)packed_matches.data(), match_size);
-    out.write((char*)model_data.data(), model_size);
-    
-    out.close();
+    // we package everything into a single buffer with a header, followed by the blocks in order.
+    // see format.h for the layout.
+    std::vector<uint8_t> out;
+    WriteFrameHeader(out, MakeFrameHeader(data.size(), blocks.size(), options));
+
+    for (const EncodedBlock& block : blocks) {
+        AppendBlock(out, block);
+        if (block.header.stored) {
+            out.insert(out.end(), data.begin() + block.offset, data.begin() + block.offset + block.header.raw_size);
+        }
+    }
+    if (options.cache) options.cache->Store(key, out);
+    return out;
+}
+
+void Compress(const std::string& input_path, const std::string& output_path, const CompressOptions& options) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    InputFile in;
+    std::vector<uint8_t> data;
+    if (!in.Open(input_path) || !in.ReadAll(data)) {
+        std::cerr << "Failed to open input file: " << input_path << "\n";
+        return;
+    }
+
+    if (data.empty()) return;
+
+    std::cout << "Input size: " << data.size() << " bytes\n";
+
+    uint64_t compressed_size = 0;
+    OutputFile out;
+    bool ok = true;
+    if (options.cache) {
+        // a cache entry is a whole file, so with a cache we build the output in memory
+        // and stored blocks don't get the kernel copy.
+        std::vector<uint8_t> compressed = CompressBuffer(data, options);
+        if (compressed.empty()) {
+            std::cerr << "Compression cancelled\n";
+            return;
+        }
+        if (!out.Open(output_path)) {
+            std::cerr << "Failed to open output file: " << output_path << "\n";
+            return;
+        }
+        ok = out.Write(compressed.data(), compressed.size());
+        compressed_size = compressed.size();
+    } else {
+        std::vector<EncodedBlock> blocks;
+        if (!CompressBlocks(data, options, blocks)) {
+            std::cerr << "Compression cancelled\n";
+            return;
+        }
+
+        if (!out.Open(output_path)) {
+            std::cerr << "Failed to open output file: " << output_path << "\n";
+            return;
+        }
+
+        std::vector<uint8_t> header;
+        WriteFrameHeader(header, MakeFrameHeader(data.size(), blocks.size(), options));
+        ok = out.Write(header.data(), header.size());
+
+        compressed_size = header.size();
+        for (const EncodedBlock& block : blocks) {
+            std::vector<uint8_t> bytes;
+            AppendBlock(bytes, block);
+            ok = ok && out.Write(bytes.data(), bytes.size());
+            compressed_size += bytes.size();
+            if (!block.header.stored) continue;
+
+            // stored blocks go straight from the input file to the output file. when the input was a pipe
+            // it's already used up, so they come from our copy instead.
+            if (in.Seekable()) {
+                ok = ok && in.Seek(block.offset) && out.CopyFrom(in, block.header.raw_size);
+            } else {
+                ok = ok && out.Write(data.data() + block.offset, block.header.raw_size);
+            }
+            compressed_size += block.header.raw_size;
+        }
+    }
+    if (!out.Close() || !ok) {
+        std::cerr << "Failed to write output file: " << output_path << "\n";
+        return;
+    }
 
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = end_time - start_time;
     double time_s = elapsed.count();
     
-    uint64_t compressed_size = 24 + rans_size + flags_size + match_size + model_size;
+    uint64_t orig_size = data.size();
     double ratio = (double)orig_size / compressed_size;
     
     // weissman score: a metric from silicon valley to measure compression efficiency.
@@ -177,80 +729,1063 @@ void Compress(const std::string& input_path, const std::string& output_path) {
 }
 
 
-void Decompress(const std::string& input_path, const std::string& output_path) {
-    std::ifstream in(input_path, std::ios::binary);
-    if (!in) {
+// the fast loop only runs while the output has room for the longest match plus this much slack,
+// so matches can be copied 8 bytes at a time and are allowed to overshoot.
+constexpr size_t kCopySlack = 8;
+constexpr size_t kFastOutputMargin = 255 + kCopySlack;
+// and while the match stream holds at least one complete record of the longest kind:
+// a run token is a zero distance plus a varint length of up to 5 bytes.
+constexpr size_t kFastMatchMargin = 2 + 5;
+
+// the literals of a block that splits them (see LiteralSplit), other than the main stream's, all decoded.
+struct SideLiterals {
+    LiteralSplit split = LiteralSplit::kNone;
+    std::vector<uint8_t> streams[kMaxLiteralStreams - 1];
+};
+
+// copies a match inside the fast loop. far-away sources go 8 bytes at a time,
+// overlapping ones (distance < 8) byte by byte so the repeat pattern comes out right.
+static inline void CopyMatchFast(uint8_t* op, size_t dist, size_t len) {
+    const uint8_t* src = op - dist;
+    if (dist >= kCopySlack) {
+        for (size_t i = 0; i < len; i += kCopySlack) std::memcpy(op + i, src + i, kCopySlack);
+    } else {
+        for (size_t i = 0; i < len; ++i) op[i] = src[i];
+    }
+}
+
+// reads a run token's varint length. returns nullptr if it runs off the end of the stream or is too long.
+static inline const uint8_t* ReadRunLength(const uint8_t* p, const uint8_t* end, uint64_t& run) {
+    run = 0;
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (p >= end) return nullptr;
+        uint8_t b = *p++;
+        run |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return p;
+    }
+    return nullptr;
+}
+
+// runs a block's tokens, starting at flag 'flag_index' and byte 'match_offset' of the match stream,
+// until 'raw_size' bytes have been appended to 'output'. the first 'literal_count' literals are already
+// decoded; if there's a 'pipeline', more of them turn up there as its helpers get through the stream.
+// if the block splits its literals, 'side' holds the ones that aren't in the main stream, all decoded.
+// 'history' is how many bytes before the new output its matches are allowed to reach into
+// (the primed tail of the previous block). if 'zero_runs' is set, every run token of zeros is recorded
+// there so the writer can leave a hole.
+//
+// decoding happens in two tiers. the fast loop runs while there's enough room left in both the output
+// and the match stream that no token can overrun either, so it never checks capacity and writes through
+// a raw pointer. the careful loop takes over for the last few hundred bytes, checking everything.
+// either way the only thing a token can't be trusted with is its distance, which is always checked.
+static bool RunTokens(const std::vector<uint8_t>& flags_data, size_t flag_index,
+                      const std::vector<uint8_t>& match_data, size_t match_offset,
+                      const uint8_t* literals, size_t literal_count, const SideLiterals* side,
+                      RansPipeline* pipeline, uint32_t raw_size, size_t history, std::vector<uint8_t>& output,
+                      std::vector<ZeroRun>* zero_runs) {
+    if (flag_index > flags_data.size() * 8 || match_offset > match_data.size()) {
+        std::cerr << "Invalid checkpoint\n";
+        return false;
+    }
+    // 'lend' is how far the literals are known to be decoded. running into it is the only time
+    // we look at the pipeline, so the token loop stays as tight as with a finished buffer.
+    const uint8_t* lp = literals;
+    const uint8_t* lend = lp + literal_count;
+    auto more_literals = [&]() {
+        if (pipeline) lend = literals + pipeline->Wait(lp - literals);
+        return lp < lend;
+    };
+    // the other streams of a split block are read through 'sp'. 'follows_match' is only ever set when the literals
+    // after matches are split, and 'utf8' when they're split by utf-8, so otherwise only stream 0 is read.
+    const bool after_split = side && side->split == LiteralSplit::kAfterMatch;
+    const bool utf8 = side && side->split == LiteralSplit::kUtf8;
+    const uint8_t* sp[kMaxLiteralStreams] = {};
+    const uint8_t* send[kMaxLiteralStreams] = {};
+    for (int s = 1; side && s < kMaxLiteralStreams; ++s) {
+        sp[s] = side->streams[s - 1].data();
+        send[s] = sp[s] + side->streams[s - 1].size();
+    }
+    bool follows_match = false;
+
+    // the whole block is allocated up front. from here on output only grows by moving 'op'.
+    size_t block_start = output.size();
+    output.resize(block_start + raw_size);
+    uint8_t* const base = output.data();
+    const uint8_t* const lowest = base + block_start - history; // oldest byte a match may copy from
+    uint8_t* op = base + block_start;
+    uint8_t* const oend = op + raw_size;
+    uint8_t* const fast_end = raw_size > kFastOutputMargin ? oend - kFastOutputMargin : op;
+    const uint8_t* const first = op;
+    auto literal_stream = [&]() { return follows_match ? 1 : utf8 ? Utf8Stream(op, op - first) : 0; };
+
+    const uint8_t* mp = match_data.data() + match_offset;
+    const uint8_t* const mend = match_data.data() + match_data.size();
+    const uint8_t* const mfast_end = (size_t)(mend - mp) > kFastMatchMargin ? mend - kFastMatchMargin : mp;
+
+    // flags are consumed a byte at a time, most significant bit first.
+    // past the end of the stream every flag reads as 0, same as BitReader.
+    const uint8_t* fp = flags_data.data() + flag_index / 8;
+    const uint8_t* const fend = flags_data.data() + flags_data.size();
+    uint32_t flag_bits = 0;
+    int flags_left = 0;
+    if (flag_index % 8) {
+        flag_bits = *fp++;
+        flags_left = 8 - flag_index % 8;
+    }
+    auto next_flag = [&]() -> bool {
+        if (flags_left == 0) {
+            flag_bits = fp < fend ? *fp++ : 0;
+            flags_left = 8;
+        }
+        flags_left--;
+        return (flag_bits >> flags_left) & 1;
+    };
+
+    while (op < oend) {
+        // fast loop: no capacity checks. a match writes at most 255 + 7 bytes and reads at most
+        // 7 bytes of match stream, both of which the loop condition guarantees are there.
+        while (op < fast_end && mp < mfast_end) {
+            if (!next_flag()) {
+                if (int s = literal_stream()) {
+                    if (sp[s] == send[s]) {
+                        std::cerr << "Literal underflow!\n";
+                        return false;
+                    }
+                    *op++ = *sp[s]++;
+                    follows_match = false;
+                    continue;
+                }
+                if (lp == lend && !more_literals()) {
+                    std::cerr << "Literal underflow!\n";
+                    return false;
+                }
+                *op++ = *lp++;
+                continue;
+            }
+            follows_match = after_split;
+            size_t dist = mp[0] | (mp[1] << 8);
+            if (dist == 0) {
+                uint64_t run;
+                mp = ReadRunLength(mp + 2, mend, run);
+                if (!mp || op == lowest || run > (size_t)(oend - op)) {
+                    std::cerr << "Invalid run token\n";
+                    return false;
+                }
+                if (zero_runs && op[-1] == 0) zero_runs->push_back({(size_t)(op - base), run});
+                std::memset(op, op[-1], run);
+                op += run;
+                continue;
+            }
+            size_t len = mp[2];
+            mp += 3;
+            // a match can only see the block itself plus the primed history before it.
+            if (dist > (size_t)(op - lowest)) {
+                std::cerr << "Invalid distance: " << dist << " > " << (op - lowest) << "\n";
+                return false;
+            }
+            CopyMatchFast(op, dist, len);
+            op += len;
+        }
+        if (op >= oend) break;
+
+        // careful loop: one token with every check, then back to the top to see if the fast loop can resume.
+        if (!next_flag()) {
+            if (int s = literal_stream()) {
+                if (sp[s] == send[s]) {
+                    std::cerr << "Literal underflow!\n";
+                    return false;
+                }
+                *op++ = *sp[s]++;
+                follows_match = false;
+                continue;
+            }
+            if (lp == lend && !more_literals()) {
+                std::cerr << "Literal underflow!\n";
+                return false;
+            }
+            *op++ = *lp++;
+            continue;
+        }
+        follows_match = after_split;
+        if (mend - mp < 3) {
+            std::cerr << "Match data underflow!\n";
+            return false;
+        }
+        size_t dist = mp[0] | (mp[1] << 8);
+        if (dist == 0) {
+            // run token: a varint length, then the previous byte repeated that many times.
+            uint64_t run;
+            mp = ReadRunLength(mp + 2, mend, run);
+            if (!mp || op == lowest || run > (size_t)(oend - op)) {
+                std::cerr << "Invalid run token\n";
+                return false;
+            }
+            // expanding a run is just a memset.
+            if (zero_runs && op[-1] == 0) zero_runs->push_back({(size_t)(op - base), run});
+            std::memset(op, op[-1], run);
+            op += run;
+            continue;
+        }
+        size_t len = mp[2];
+        mp += 3;
+        if (dist > (size_t)(op - lowest)) {
+            std::cerr << "Invalid distance: " << dist << " > " << (op - lowest) << "\n";
+            return false;
+        }
+        if (len > (size_t)(oend - op)) {
+            std::cerr << "Match overruns block\n";
+            return false;
+        }
+        const uint8_t* src = op - dist;
+        for (size_t i = 0; i < len; ++i) op[i] = src[i];
+        op += len;
+    }
+    return true;
+}
+
+// sets 'rans' up with a block's literal model: the built-in one its header names, or the one it stores, or
+// without either the dictionary's. the built-in and dictionary models come with their tables ready to go.
+static bool SetLiteralModel(const std::vector<uint8_t>& model_data, BuiltinModel builtin, const Dictionary* dictionary,
+                            RansDecoder& rans) {
+    if (builtin != BuiltinModel::kNone) {
+        rans.SetTable(BuiltinRansTable(builtin));
+    } else if (model_data.empty() && dictionary) {
+        rans.SetTable(dictionary->RansTable());
+    } else if (!rans.SetModel(model_data)) {
+        std::cerr << "Invalid literal model\n";
+        return false;
+    }
+    return true;
+}
+
+// decodes one whole block and appends it to 'output'.
+// on one thread the literals are decoded first, all at once, and the token loop just takes them from a buffer.
+// with more, the other threads decode the literal segments in the background (several at a time for a big
+// block) while this one runs the tokens as soon as the literals they need are there.
+// 'side' is set if the block splits its literals (see RunTokens), and 'rans_data' then holds the main stream.
+bool DecompressBlock(const std::vector<uint8_t>& rans_data, const SideLiterals* side,
+                     const std::vector<uint8_t>& flags_data,
+                     const std::vector<uint8_t>& match_data, const std::vector<uint8_t>& model_data,
+                     BuiltinModel builtin, uint32_t raw_size, size_t history, std::vector<uint8_t>& output,
+                     std::vector<ZeroRun>* zero_runs, int threads, const Dictionary* dictionary) {
+    RansDecoder rans;
+    if (!SetLiteralModel(model_data, builtin, dictionary, rans)) return false;
+    // a block can't have more literals than bytes.
+    if (threads > 1) {
+        RansPipeline pipeline;
+        if (!pipeline.Start(rans, rans_data.data(), rans_data.size(), raw_size, threads - 1)) {
+            std::cerr << "Corrupt literal stream\n";
+            return false;
+        }
+        if (!RunTokens(flags_data, 0, match_data, 0, pipeline.Data(), 0, side, &pipeline, raw_size, history,
+                       output, zero_runs)) {
+            return false;
+        }
+        if (!pipeline.Finish()) {
+            std::cerr << "Corrupt literal stream\n";
+            return false;
+        }
+        return true;
+    }
+    std::vector<uint8_t> literals;
+    if (!rans.DecodeSegmented(rans_data.data(), rans_data.size(), raw_size, literals, 1)) {
+        std::cerr << "Corrupt literal stream\n";
+        return false;
+    }
+    return RunTokens(flags_data, 0, match_data, 0, literals.data(), literals.size(), side, nullptr, raw_size,
+                     history, output, zero_runs);
+}
+
+// decodes the 'size' bytes at 'p' written by EncodeWithModel into 'out', on up to 'threads' threads.
+// 'what' names the stream in the errors. returns false if it's malformed or holds more than 'max_symbols' symbols.
+static bool DecodeWithModel(const uint8_t* p, size_t size, size_t max_symbols, int threads, const char* what,
+                            std::vector<uint8_t>& out) {
+    size_t model_size = size >= 4 ? GetU32(p) : SIZE_MAX;
+    if (model_size > size - 4) {
+        std::cerr << "Corrupt " << what << " stream\n";
+        return false;
+    }
+    RansDecoder rans;
+    if (!rans.SetModel(std::vector<uint8_t>(p + 4, p + 4 + model_size))) {
+        std::cerr << "Invalid " << what << " model\n";
+        return false;
+    }
+    const uint8_t* stream = p + 4 + model_size;
+    if (!rans.DecodeSegmented(stream, p + size - stream, max_symbols, out, threads)) {
+        std::cerr << "Corrupt " << what << " stream\n";
+        return false;
+    }
+    return true;
+}
+
+// reads a block's flags at 'p' as raw bits, decoding them first (on up to 'threads' threads) if they're coded.
+static bool ReadFlags(const BlockHeader& header, const uint8_t* p, int threads, std::vector<uint8_t>& flags) {
+    if (!header.coded_flags) {
+        flags.assign(p, p + header.flags_size);
+        return true;
+    }
+    // every token is at least a byte, so there's at most a flag per byte of the block.
+    return DecodeWithModel(p, header.flags_size, header.raw_size / 8 + 1, threads, "flag", flags);
+}
+
+// decodes the block whose payload starts at 'payload' and appends it to 'output'.
+// with a 'dictionary', it's the block's history and 'history' is ignored.
+static bool DecodeBlock(const BlockHeader& header, const uint8_t* payload, size_t history,
+                        std::vector<uint8_t>& output, std::vector<ZeroRun>* zero_runs, int threads,
+                        const Dictionary* dictionary) {
+    if (header.stored) {
+        output.insert(output.end(), payload, payload + header.raw_size);
+        return true;
+    }
+    if (header.transform != BlockTransform::kNone) {
+        // the tokens rebuild the transformed block behind the usual history, which is then expanded in its place.
+        // a transform is only used when it shrinks the block.
+        if (header.transformed_size > header.raw_size) {
+            std::cerr << "Corrupt block header\n";
+            return false;
+        }
+        BlockHeader inner = header;
+        inner.transform = BlockTransform::kNone;
+        inner.raw_size = header.transformed_size;
+        size_t start = output.size();
+        if (!DecodeBlock(inner, payload, history, output, nullptr, threads, dictionary)) return false;
+        std::vector<uint8_t> transformed(output.begin() + start, output.end());
+        output.resize(start);
+        bool ok = header.transform == BlockTransform::kJson
+                      ? InverseJsonTransform(transformed.data(), transformed.size(), header.raw_size, output)
+                      : InverseWordTransform(transformed.data(), transformed.size(), header.raw_size, output);
+        if (!ok) {
+            std::cerr << "Corrupt transformed block\n";
+            return false;
+        }
+        return true;
+    }
+    const uint8_t* p = payload;
+    std::vector<uint8_t> rans_data(p, p + header.rans_size);
+    // split literals: [size] [the main stream], then the others with their own models, all but the last
+    // after their size.
+    SideLiterals side;
+    side.split = header.literal_split;
+    int num_streams = LiteralStreams(header.literal_split);
+    const uint8_t* stream = p;
+    const uint8_t* const streams_end = p + header.rans_size;
+    for (int s = 0; num_streams > 1 && s < num_streams; ++s) {
+        size_t size = streams_end - stream;
+        if (s + 1 < num_streams) {
+            size = size >= 4 ? GetU32(stream) : SIZE_MAX;
+            if (size > (size_t)(streams_end - stream) - 4) {
+                std::cerr << "Corrupt literal stream\n";
+                return false;
+            }
+            stream += 4;
+        }
+        if (s == 0) {
+            rans_data.assign(stream, stream + size);
+        } else if (!DecodeWithModel(stream, size, header.raw_size, threads, "literal", side.streams[s - 1])) {
+            return false;
+        }
+        stream += size;
+    }
+    const SideLiterals* side_literals = num_streams > 1 ? &side : nullptr;
+    p += header.rans_size;
+    std::vector<uint8_t> flags_data;
+    if (!ReadFlags(header, p, threads, flags_data)) return false;
+    p += header.flags_size;
+    std::vector<uint8_t> match_data(p, p + header.match_size);
+    p += header.match_size;
+    std::vector<uint8_t> model_data(p, p + header.model_size);
+    if (!dictionary) {
+        return DecompressBlock(rans_data, side_literals, flags_data, match_data, model_data, header.builtin_model,
+                               header.raw_size, history, output, zero_runs, threads, nullptr);
+    }
+
+    // 'output' ends with the previous block, so the block is decoded behind a copy of the dictionary
+    // and moved over, zero runs and all.
+    size_t size = dictionary->Size();
+    std::vector<uint8_t> window(dictionary->Content(), dictionary->Content() + size);
+    size_t first_run = zero_runs ? zero_runs->size() : 0;
+    if (!DecompressBlock(rans_data, side_literals, flags_data, match_data, model_data, header.builtin_model,
+                         header.raw_size, size, window, zero_runs, threads, dictionary)) {
+        return false;
+    }
+    if (zero_runs) {
+        for (size_t r = first_run; r < zero_runs->size(); ++r) (*zero_runs)[r].offset += output.size() - size;
+    }
+    output.insert(output.end(), window.begin() + size, window.end());
+    return true;
+}
+
+// decodes at least block bytes [begin, end) of a block without priming and appends them to 'output'.
+// decoding starts at the last checkpoint at or before 'begin' and stops at the first one at or after 'end',
+// so a little more than was asked for comes out; 'first' is set to the block position of the first new byte.
+// with a 'dictionary', the first interval has it as history.
+static bool DecodeBlockRange(const BlockHeader& header, const uint8_t* payload, size_t begin, size_t end,
+                             std::vector<uint8_t>& output, size_t& first, const Dictionary* dictionary) {
+    if (header.stored) {
+        output.insert(output.end(), payload + begin, payload + end);
+        first = begin;
+        return true;
+    }
+    // a position in a transformed block only means something once the whole block is expanded.
+    // a block with split literals has no checkpoints, so it's decoded whole too.
+    if (header.transform != BlockTransform::kNone || header.literal_split != LiteralSplit::kNone) {
+        first = 0;
+        return DecodeBlock(header, payload, 0, output, nullptr, 1, dictionary);
+    }
+    const uint8_t* p = payload;
+    const uint8_t* rans_data = p;
+    p += header.rans_size;
+    std::vector<uint8_t> flags_data;
+    if (!ReadFlags(header, p, 1, flags_data)) return false;
+    p += header.flags_size;
+    std::vector<uint8_t> match_data(p, p + header.match_size);
+    p += header.match_size;
+    std::vector<uint8_t> model_data(p, p + header.model_size);
+    p += header.model_size;
+
+    // the start of the block works like a checkpoint that starts every stream at zero.
+    std::vector<Checkpoint> checkpoints(1);
+    std::vector<Checkpoint> stored;
+    if (!ReadCheckpoints(p, header.checkpoints_size, stored)) {
+        std::cerr << "Corrupt checkpoints\n";
+        return false;
+    }
+    checkpoints.insert(checkpoints.end(), stored.begin(), stored.end());
+    for (size_t c = 1; c < checkpoints.size(); ++c) {
+        if (checkpoints[c].raw_pos <= checkpoints[c - 1].raw_pos || checkpoints[c].raw_pos >= header.raw_size ||
+            checkpoints[c].literal_index < checkpoints[c - 1].literal_index) {
+            std::cerr << "Corrupt checkpoints\n";
+            return false;
+        }
+    }
+    size_t from = 0;
+    while (from + 1 < checkpoints.size() && checkpoints[from + 1].raw_pos <= begin) from++;
+    size_t to = from + 1;
+    while (to < checkpoints.size() && checkpoints[to].raw_pos < end) to++;
+    const Checkpoint& start = checkpoints[from];
+    uint32_t stop = to < checkpoints.size() ? checkpoints[to].raw_pos : header.raw_size;
+    size_t literal_count = to < checkpoints.size() ? checkpoints[to].literal_index - start.literal_index : SIZE_MAX;
+
+    RansDecoder rans;
+    if (!SetLiteralModel(model_data, header.builtin_model, dictionary, rans)) return false;
+    RansCheckpoint rans_start = {start.rans_state, start.rans_offset};
+    std::vector<uint8_t> literals;
+    if (!rans.DecodeSegmentedRange(rans_data, header.rans_size, header.raw_size, start.literal_index, literal_count,
+                                   from > 0 ? &rans_start : nullptr, literals)) {
+        std::cerr << "Corrupt literal stream\n";
+        return false;
+    }
+    first = start.raw_pos;
+    if (from > 0 || !dictionary) {
+        return RunTokens(flags_data, start.flag_index, match_data, start.match_offset, literals.data(),
+                         literals.size(), nullptr, nullptr, stop - start.raw_pos, 0, output, nullptr);
+    }
+    size_t size = dictionary->Size();
+    std::vector<uint8_t> window(dictionary->Content(), dictionary->Content() + size);
+    if (!RunTokens(flags_data, 0, match_data, 0, literals.data(), literals.size(), nullptr, nullptr, stop, size,
+                   window, nullptr)) {
+        return false;
+    }
+    output.insert(output.end(), window.begin() + size, window.end());
+    return true;
+}
+
+// appends the part of a block that overlaps the original bytes [offset, offset + length) to 'out'.
+// 'block_start' is where the block begins in the original data.
+static bool AppendBlockRange(const BlockHeader& header, const uint8_t* payload, uint64_t block_start,
+                             uint64_t offset, uint64_t length, std::vector<uint8_t>& out,
+                             const Dictionary* dictionary) {
+    uint64_t block_end = block_start + header.raw_size;
+    if (block_end <= offset || block_start >= offset + length) return true;
+    size_t begin = std::max(offset, block_start) - block_start;
+    size_t end = std::min(offset + length, block_end) - block_start;
+    std::vector<uint8_t> part;
+    size_t first;
+    if (!DecodeBlockRange(header, payload, begin, end, part, first, dictionary)) return false;
+    out.insert(out.end(), part.begin() + (begin - first), part.begin() + (end - first));
+    return true;
+}
+
+bool DecompressBuffer(const std::vector<uint8_t>& compressed, std::vector<uint8_t>& output,
+                      const DecompressOptions& options) {
+    FrameHeader frame;
+    if (compressed.size() < kFrameHeaderSize || !ReadFrameHeader(compressed.data(), frame)) {
+        std::cerr << "Invalid magic number\n";
+        return false;
+    }
+    const Dictionary* dictionary;
+    if (!FrameDictionary(frame, options.dictionary, dictionary)) return false;
+
+    // the frame header is only trusted as far as the input can back it: a forged orig_size would otherwise
+    // reserve gigabytes up front. anything that really expands further (long runs) just grows the buffer.
+    output.clear();
+    if (!frame.Streaming()) {
+        output.reserve(std::min<uint64_t>(frame.orig_size, (uint64_t)compressed.size() * kMaxReserveRatio));
+    }
+
+    size_t pos = kFrameHeaderSize;
+    uint64_t total = frame.Streaming() ? UINT64_MAX : frame.orig_size;
+    for (uint32_t b = 0; frame.Streaming() || b < frame.num_blocks; ++b) {
+        if (frame.Streaming() && IsEndOfFrame(compressed.data() + pos, compressed.size() - pos)) return true;
+        if (Cancelled(options.cancel)) {
+            std::cerr << "Decompression cancelled\n";
+            return false;
+        }
+        BlockHeader header;
+        if (!ReadBlockHeader(compressed.data() + pos, compressed.size() - pos, header) ||
+            !frame.BlockFits(output.size(), header.raw_size) ||
+            header.PayloadSize() > compressed.size() - pos - header.HeaderSize()) {
+            std::cerr << "Corrupt block header\n";
+            return false;
+        }
+        pos += header.HeaderSize();
+
+        // the decoder only needs the tail of the block before this one, which it has just produced.
+        size_t history = std::min<size_t>(frame.prime_size, output.size());
+        if (!DecodeBlock(header, compressed.data() + pos, history, output, nullptr, options.threads, dictionary)) {
+            return false;
+        }
+        pos += header.PayloadSize();
+        if (options.progress) options.progress(output.size(), total);
+    }
+    return output.size() == frame.orig_size;
+}
+
+bool DecompressRange(const std::vector<uint8_t>& compressed, uint64_t offset, uint64_t length,
+                     std::vector<uint8_t>& out, const Dictionary* given) {
+    FrameHeader frame;
+    if (compressed.size() < kFrameHeaderSize || !ReadFrameHeader(compressed.data(), frame)) {
+        std::cerr << "Invalid magic number\n";
+        return false;
+    }
+    const Dictionary* dictionary;
+    if (!FrameDictionary(frame, given, dictionary)) return false;
+    // a streaming frame doesn't know its size, so a range past its end only shows at the end.
+    if (!frame.Streaming() && (offset > frame.orig_size || length > frame.orig_size - offset)) {
+        std::cerr << "Range is outside the data\n";
+        return false;
+    }
+    out.clear();
+
+    // a primed block needs the tail of the one before it, and that one the one before it,
+    // so there's no shortcut: everything up to the range gets decoded.
+    if (frame.prime_size > 0) {
+        std::vector<uint8_t> all;
+        DecompressOptions options;
+        options.dictionary = dictionary;
+        if (!DecompressBuffer(compressed, all, options)) return false;
+        if (offset > all.size() || length > all.size() - offset) {
+            std::cerr << "Range is outside the data\n";
+            return false;
+        }
+        out.assign(all.begin() + offset, all.begin() + offset + length);
+        return true;
+    }
+
+    // otherwise only the blocks that overlap the range are touched, each from the checkpoint nearest the range.
+    size_t pos = kFrameHeaderSize;
+    uint64_t block_start = 0;
+    for (uint32_t b = 0; (frame.Streaming() || b < frame.num_blocks) && block_start < offset + length; ++b) {
+        if (frame.Streaming() && IsEndOfFrame(compressed.data() + pos, compressed.size() - pos)) break;
+        BlockHeader header;
+        if (!ReadBlockHeader(compressed.data() + pos, compressed.size() - pos, header) ||
+            !frame.BlockFits(block_start, header.raw_size) ||
+            header.PayloadSize() > compressed.size() - pos - header.HeaderSize()) {
+            std::cerr << "Corrupt block header\n";
+            return false;
+        }
+        pos += header.HeaderSize();
+        if (!AppendBlockRange(header, compressed.data() + pos, block_start, offset, length, out, dictionary)) {
+            return false;
+        }
+        pos += header.PayloadSize();
+        block_start += header.raw_size;
+    }
+    if (out.size() != length) {
+        std::cerr << "Range is outside the data\n";
+        return false;
+    }
+    return true;
+}
+
+// whether a block's payload is no bigger than a genuine one can be. a compressed block is always smaller than
+// its raw bytes (it would have been stored otherwise), which keeps a corrupt header read from a file
+// from making us allocate gigabytes.
+static bool PayloadFits(const BlockHeader& header) {
+    return header.stored || header.PayloadSize() <= header.raw_size;
+}
+
+void DecompressRange(const std::string& input_path, const std::string& output_path, uint64_t offset,
+                     uint64_t length, const Dictionary* given) {
+    InputFile in;
+    if (!in.Open(input_path)) {
         std::cerr << "Failed to open input file: " << input_path << "\n";
         return;
     }
-    
-    uint32_t magic, orig_size, rans_size, flags_size, match_size, model_size;
-    in.read((char*)&magic, 4);
-    if (magic != 0x4D49444F) {
+    uint8_t header_bytes[kMaxBlockHeaderSize];
+    FrameHeader frame;
+    if (!in.Read(header_bytes, kFrameHeaderSize) || !ReadFrameHeader(header_bytes, frame)) {
         std::cerr << "Invalid magic number\n";
         return;
     }
-    in.read((char*)&orig_size, 4);
-    in.read((char*)&rans_size, 4);
-    in.read((char*)&flags_size, 4);
-    in.read((char*)&match_size, 4);
-    in.read((char*)&model_size, 4);
+    const Dictionary* dictionary;
+    if (!FrameDictionary(frame, given, dictionary)) return;
 
-    std::vector<uint8_t> rans_data(rans_size);
-    std::vector<uint8_t> flags_data(flags_size);
-    std::vector<uint8_t> match_data(match_size);
-    std::vector<uint8_t> model_data(model_size);
+    std::vector<uint8_t> range;
+    bool ok = true;
+    if (frame.prime_size > 0 ||
+        (!frame.Streaming() && (offset > frame.orig_size || length > frame.orig_size - offset))) {
+        // the in-memory version has to decode everything anyway (and reports a bad range).
+        std::vector<uint8_t> compressed(header_bytes, header_bytes + kFrameHeaderSize);
+        ok = in.ReadAll(compressed) && DecompressRange(compressed, offset, length, range, dictionary);
+    } else {
+        // walk the block headers, skipping the payloads of blocks outside the range.
+        std::vector<uint8_t> payload;
+        uint64_t block_start = 0;
+        for (uint32_t b = 0; (frame.Streaming() || b < frame.num_blocks) && block_start < offset + length && ok;
+             ++b) {
+            BlockHeader header;
+            ok = in.Read(header_bytes, kStoredHeaderSize);
+            if (ok && frame.Streaming() && IsEndOfFrame(header_bytes, kStoredHeaderSize)) break;
+            size_t header_size = BlockHeaderSize(GetU32(header_bytes));
+            ok = ok && in.Read(header_bytes + kStoredHeaderSize, header_size - kStoredHeaderSize) &&
+                 ReadBlockHeader(header_bytes, header_size, header);
+            if (!ok || !frame.BlockFits(block_start, header.raw_size) || !PayloadFits(header)) {
+                std::cerr << "Corrupt block header\n";
+                ok = false;
+                break;
+            }
+            if (block_start + header.raw_size > offset) {
+                payload.resize(header.PayloadSize());
+                ok = in.Read(payload.data(), payload.size()) &&
+                     AppendBlockRange(header, payload.data(), block_start, offset, length, range, dictionary);
+            } else {
+                ok = in.Seek(in.Offset() + header.PayloadSize());
+            }
+            block_start += header.raw_size;
+        }
+        ok = ok && range.size() == length;
+    }
 
-    in.read((char*)rans_data.data(), rans_size);
-    in.read((char*)flags_data.data(), flags_size);
-    in.read((char*)match_data.data(), match_size);
-    in.read((char*)model_data.data(), model_size);
-    in.close();
+    OutputFile out;
+    if (!ok || !out.Open(output_path) || !out.Write(range.data(), range.size()) || !out.Close()) {
+        std::cerr << "Failed to decompress " << input_path << "\n";
+        return;
+    }
+    std::cout << "Decompressed " << range.size() << " bytes at offset " << offset << ".\n";
+}
 
-    RansDecoder rans;
-    rans.Init(rans_data);
-    rans.SetModel(model_data);
+// block size for streaming compression when the options don't give one. it bounds how long a single call
+// to CompressContext::Process can take, so it's kept small.
+constexpr int kStreamBlockSize = 128 * 1024;
 
-    BitReader flags_in(flags_data);
-    
-    std::vector<uint8_t> output;
-    output.reserve(orig_size);
-
-    size_t match_ptr = 0;
-    int op_count = 0;
-    while (output.size() < orig_size) {
-        bool flag = flags_in.ReadBit();
-        op_count++;
-        if (!flag) {
-            uint8_t lit = rans.Decode();
-            output.push_back(lit);
-            // std::cout << "Lit: " << (char)lit << "\n";
-        } else {
-            if (match_ptr + 3 > match_data.size()) {
-                std::cerr << "Match data underflow!\n";
-                break;
-            }
-            uint16_t dist = match_data[match_ptr] | (match_data[match_ptr+1] << 8);
-            uint8_t len = match_data[match_ptr+2];
-            match_ptr += 3;
+CompressContext::CompressContext(const CompressOptions& opts) : options(opts) {
+    block_size = std::min<int>(options.block_size > 0 ? options.block_size : kStreamBlockSize, kMaxBlockSize);
+    prime_size = MakeFrameHeader(0, 0, options).prime_size;
+    // a dictionary is the history of every block, and stays at the front of 'data' for good.
+    if (options.dictionary) {
+        data.assign(options.dictionary->Content(), options.dictionary->Content() + options.dictionary->Size());
+        history = data.size();
+    }
+}
 
-            // std::cout << "Match: dist=" << dist << " len=" << (int)len << "\n";
+void CompressContext::CompressPending() {
+    // 'data' holds nothing but the history and the block, so the history starts at 0.
+    int begin = history;
+    int end = data.size();
+    EncodedBlock block = CompressBlock(data, begin, end, 0, GetMatchParams(options.level), options.threads,
+                                       options.checkpoint_size, options.dictionary, options.text,
+                                       options.json);
+    AppendBlock(out, block);
+    if (block.header.stored) out.insert(out.end(), data.begin() + begin, data.end());
 
-            if (dist > output.size()) {
-                 std::cerr << "Invalid distance: " << dist << " > " << output.size() << "\n";
-                 break;
-            }
+    if (options.dictionary) {
+        data.resize(history);
+        return;
+    }
+    // keep only what the next block gets primed with.
+    size_t keep = std::min<size_t>(prime_size, data.size());
+    data.erase(data.begin(), data.end() - keep);
+    history = keep;
+}
 
-            int start = output.size() - dist;
-            for (int i = 0; i < len; ++i) {
-                output.push_back(output[start + i]);
-            }
+StreamStatus CompressContext::Process(StreamBuffers& buffers, bool finish) {
+    bool compressed = false;
+    while (true) {
+        // whatever is already compressed goes out first.
+        size_t n = std::min(buffers.avail_out, out.size() - out_pos);
+        if (n > 0) {
+            std::memcpy(buffers.next_out, out.data() + out_pos, n);
+            buffers.next_out += n;
+            buffers.avail_out -= n;
+            out_pos += n;
+        }
+        if (out_pos < out.size()) return StreamStatus::kNeedOutput;
+        out.clear();
+        out_pos = 0;
+        if (finished) return StreamStatus::kEnd;
+
+        if (!started) {
+            FrameHeader frame = MakeFrameHeader(0, 0, options);
+            frame.orig_size = kUnknownSize;
+            frame.num_blocks = kUnknownSize;
+            WriteFrameHeader(out, frame);
+            started = true;
+            continue;
+        }
+
+        // fill up the next block from the input.
+        size_t take = std::min(buffers.avail_in, history + block_size - data.size());
+        if (take > 0) {
+            data.insert(data.end(), buffers.next_in, buffers.next_in + take);
+            buffers.next_in += take;
+            buffers.avail_in -= take;
+        }
+        bool last = finish && buffers.avail_in == 0;
+        if (data.size() - history == (size_t)block_size || (last && data.size() > history)) {
+            // one block per call, however much input there is.
+            if (compressed) return StreamStatus::kContinue;
+            CompressPending();
+            compressed = true;
+            continue;
+        }
+        if (last) {
+            PutU32(out, kEndOfFrame);
+            finished = true;
+            continue;
+        }
+        return StreamStatus::kNeedInput;
+    }
+}
+
+DecompressContext::DecompressContext(const DecompressOptions& opts) : options(opts), frame(new FrameHeader()) {}
+DecompressContext::~DecompressContext() = default;
+
+// works out how many bytes the next step needs in 'in': the frame header, the first word of a block,
+// its header, or the whole block. returns false if what has arrived so far is already corrupt.
+bool DecompressContext::Wanted(size_t& need) {
+    if (!have_frame) {
+        need = kFrameHeaderSize;
+        return true;
+    }
+    need = kStoredHeaderSize;
+    if (in.size() < need) return true;
+    uint32_t word = GetU32(in.data());
+    if (frame->Streaming() && word == kEndOfFrame) return true;
+    need = BlockHeaderSize(word);
+    if (in.size() < need) return true;
+
+    // the payload bound also keeps a corrupt header from making us wait for gigabytes.
+    BlockHeader header;
+    if (!ReadBlockHeader(in.data(), in.size(), header) || !frame->BlockFits(position, header.raw_size) ||
+        !PayloadFits(header)) {
+        std::cerr << "Corrupt block header\n";
+        return false;
+    }
+    need = header.HeaderSize() + header.PayloadSize();
+    return true;
+}
+
+// acts on a complete frame header or block in 'in'.
+bool DecompressContext::Step() {
+    if (!have_frame) {
+        if (!ReadFrameHeader(in.data(), *frame)) {
+            std::cerr << "Invalid magic number\n";
+            return false;
         }
+        if (!FrameDictionary(*frame, options.dictionary, dictionary)) return false;
+        have_frame = true;
+        done = !frame->Streaming() && frame->num_blocks == 0;
+        in.clear();
+        return true;
+    }
+    if (frame->Streaming() && IsEndOfFrame(in.data(), in.size())) {
+        done = true;
+        in.clear();
+        return true;
+    }
+
+    // everything in the window has been handed out, so only the primed tail needs to stay.
+    if (window.size() > frame->prime_size) {
+        window.erase(window.begin(), window.end() - frame->prime_size);
     }
-    std::cout << "Decompression ops: " << op_count << "\n";
+    out_pos = window.size();
 
-    std::ofstream out(output_path, std::ios::binary);
-    out.write((char*)output.data(), output.size());
-    out.close();
-    std::cout << "Decompressed " << output.size() << " bytes.\n";
+    BlockHeader header;
+    ReadBlockHeader(in.data(), in.size(), header);
+    if (!DecodeBlock(header, in.data() + header.HeaderSize(), window.size(), window, nullptr, options.threads,
+                     dictionary)) {
+        return false;
+    }
+    position += header.raw_size;
+    blocks_done++;
+    done = !frame->Streaming() && blocks_done == frame->num_blocks;
+    in.clear();
+    return true;
+}
+
+StreamStatus DecompressContext::Process(StreamBuffers& buffers) {
+    while (!failed) {
+        // whatever is already decoded goes out first.
+        size_t n = std::min(buffers.avail_out, window.size() - out_pos);
+        if (n > 0) {
+            std::memcpy(buffers.next_out, window.data() + out_pos, n);
+            buffers.next_out += n;
+            buffers.avail_out -= n;
+            out_pos += n;
+        }
+        if (out_pos < window.size()) return StreamStatus::kNeedOutput;
+        if (done) return StreamStatus::kEnd;
+
+        // gather the next piece, which may take several calls.
+        size_t need;
+        if (!Wanted(need)) break;
+        if (in.size() < need) {
+            size_t take = std::min(buffers.avail_in, need - in.size());
+            in.insert(in.end(), buffers.next_in, buffers.next_in + take);
+            buffers.next_in += take;
+            buffers.avail_in -= take;
+            if (in.size() < need) return StreamStatus::kNeedInput;
+            // a block's first words decide how much more of it there is, so ask again.
+            continue;
+        }
+        if (!Step()) break;
+    }
+    failed = true;
+    return StreamStatus::kError;
+}
+
+bool StreamDecoder::Open(const std::string& path, const DecompressOptions& opts) {
+    options = opts;
+    if (!in.Open(path)) {
+        std::cerr << "Failed to open input file: " << path << "\n";
+        return false;
+    }
+    uint8_t header_bytes[kFrameHeaderSize];
+    if (!in.Read(header_bytes, kFrameHeaderSize) || !ReadFrameHeader(header_bytes, frame)) {
+        std::cerr << "Invalid magic number\n";
+        return false;
+    }
+    if (!FrameDictionary(frame, options.dictionary, dictionary)) return false;
+    size = frame.orig_size;
+    if (frame.Streaming()) {
+        // a streaming frame only says how big it is at the end. a file can be indexed to find out,
+        // a pipe has to be read through.
+        size = UINT64_MAX;
+        if (in.Seekable()) {
+            if (!BuildIndex()) return false;
+            size = indexed_size;
+        }
+    }
+    return PeekEnd();
+}
+
+bool StreamDecoder::Done() const {
+    if (pending) return false;
+    return frame.Streaming() ? ended : next_block >= frame.num_blocks;
+}
+
+bool StreamDecoder::PeekEnd() {
+    // in a streaming frame the next header word may be the end marker, and Done has to know before
+    // anyone asks for the header. it's kept for ReadHeader otherwise.
+    if (!frame.Streaming() || peeked || ended) return true;
+    if (!in.Read(peek, kStoredHeaderSize)) {
+        std::cerr << "Corrupt block header\n";
+        return false;
+    }
+    peeked = true;
+    ended = IsEndOfFrame(peek, kStoredHeaderSize);
+    return true;
+}
+
+bool StreamDecoder::ReadHeader() {
+    if (pending) {
+        pending = false;
+        return true;
+    }
+    uint8_t header_bytes[kMaxBlockHeaderSize] = {};
+    // the first word tells us whether the rest of a full header follows.
+    bool ok = !Done();
+    if (ok && peeked) {
+        std::memcpy(header_bytes, peek, kStoredHeaderSize);
+        peeked = false;
+    } else {
+        ok = ok && in.Read(header_bytes, kStoredHeaderSize);
+    }
+    size_t header_size = BlockHeaderSize(GetU32(header_bytes));
+    ok = ok && in.Read(header_bytes + kStoredHeaderSize, header_size - kStoredHeaderSize) &&
+         ReadBlockHeader(header_bytes, header_size, header);
+    // Decode sizes its buffer from the header, so an impossible payload is turned away here.
+    if (!ok || !frame.BlockFits(position, header.raw_size) || !PayloadFits(header)) {
+        std::cerr << "Corrupt block header\n";
+        return false;
+    }
+    next_block++;
+    block_start = position;
+    return true;
+}
+
+void StreamDecoder::Trim() {
+    // only the last prime_size bytes can be referenced by the next block.
+    if (window.size() > frame.prime_size) {
+        window.erase(window.begin(), window.end() - frame.prime_size);
+    }
+}
+
+bool StreamDecoder::Decode() {
+    Trim();
+    payload.resize(header.PayloadSize());
+    block_offset = window.size();
+    zero_runs.clear();
+    if (!in.Read(payload.data(), payload.size()) ||
+        !DecodeBlock(header, payload.data(), window.size(), window, options.sparse ? &zero_runs : nullptr,
+                     options.threads, dictionary)) {
+        return false;
+    }
+    for (ZeroRun& run : zero_runs) run.offset -= block_offset;
+    position += header.raw_size;
+    return PeekEnd();
+}
+
+bool StreamDecoder::CanCopy() const {
+    return header.stored && (in.Seekable() || frame.prime_size == 0);
+}
+
+bool StreamDecoder::Copy(OutputFile& out) {
+    // zero-copy path: the stored bytes never enter user space. we only read back the tail
+    // the next block may reference, which needs a seekable input.
+    Trim();
+    size_t keep = std::min<size_t>(frame.prime_size, header.raw_size);
+    uint64_t start = in.Offset();
+    bool ok = out.CopyFrom(in, header.raw_size);
+    if (ok && keep > 0) {
+        window.resize(window.size() + keep);
+        ok = in.ReadAt(start + header.raw_size - keep, window.data() + window.size() - keep, keep);
+    }
+    block_offset = window.size();
+    position += header.raw_size;
+    return ok && PeekEnd();
+}
+
+bool StreamDecoder::Skip() {
+    // a primed block is needed for the one after it, so it has to be decoded anyway.
+    if (frame.prime_size > 0) return Decode();
+    window.clear();
+    block_offset = 0;
+    position += header.raw_size;
+    return in.Seek(in.Offset() + header.PayloadSize()) && PeekEnd();
+}
+
+bool StreamDecoder::BuildIndex() {
+    if (indexed) return true;
+    uint64_t at = kFrameHeaderSize;
+    uint64_t raw = 0;
+    for (uint32_t b = 0; frame.Streaming() || b < frame.num_blocks; ++b) {
+        uint8_t header_bytes[kMaxBlockHeaderSize] = {};
+        BlockHeader h;
+        bool ok = in.ReadAt(at, header_bytes, kStoredHeaderSize);
+        if (ok && frame.Streaming() && IsEndOfFrame(header_bytes, kStoredHeaderSize)) break;
+        size_t header_size = BlockHeaderSize(GetU32(header_bytes));
+        ok = ok && in.ReadAt(at + kStoredHeaderSize, header_bytes + kStoredHeaderSize, header_size - kStoredHeaderSize) &&
+             ReadBlockHeader(header_bytes, header_size, h);
+        if (!ok || !frame.BlockFits(raw, h.raw_size)) {
+            std::cerr << "Corrupt block header\n";
+            index.clear();
+            return false;
+        }
+        index.push_back({at, raw});
+        at += h.HeaderSize() + h.PayloadSize();
+        raw += h.raw_size;
+    }
+    indexed = true;
+    indexed_size = raw;
+    return true;
+}
+
+bool StreamDecoder::Seek(uint64_t offset) {
+    if (offset > size) return false;
+
+    // unprimed blocks stand alone, so on a seekable file we can jump straight to the right one.
+    if (frame.prime_size == 0 && in.Seekable()) {
+        if (!BuildIndex()) return false;
+        size_t b = std::upper_bound(index.begin(), index.end(), offset,
+                                    [](uint64_t o, const IndexEntry& e) { return o < e.raw_offset; }) -
+                   index.begin();
+        window.clear();
+        block_offset = 0;
+        pending = false;
+        peeked = false;
+        if (offset == size || b == 0) {
+            // the end of the data, which is also where an empty frame starts.
+            next_block = frame.Streaming() ? index.size() : frame.num_blocks;
+            ended = true;
+            position = size;
+            return offset == size;
+        }
+        next_block = b - 1;
+        ended = false;
+        position = index[b - 1].raw_offset;
+        return in.Seek(index[b - 1].file_offset);
+    }
+
+    // otherwise we go forwards block by block, from the start if the target is behind us.
+    if (offset < position) {
+        if (!in.Seekable()) {
+            std::cerr << "Can't seek backwards in a pipe\n";
+            return false;
+        }
+        if (!in.Seek(kFrameHeaderSize)) return false;
+        window.clear();
+        block_offset = 0;
+        next_block = 0;
+        position = 0;
+        pending = false;
+        peeked = false;
+        ended = false;
+        if (!PeekEnd()) return false;
+    }
+    while (!Done()) {
+        if (!ReadHeader()) return false;
+        if (offset < position + header.raw_size) {
+            // leave the header for the caller's next ReadHeader.
+            pending = true;
+            return true;
+        }
+        if (!Skip()) return false;
+    }
+    return offset == position;
+}
+
+void Decompress(const std::string& input_path, const std::string& output_path, const DecompressOptions& options) {
+    StreamDecoder decoder;
+    if (!decoder.Open(input_path, options)) return;
+
+    OutputFile out;
+    if (!out.Open(output_path)) {
+        std::cerr << "Failed to open output file: " << output_path << "\n";
+        return;
+    }
+
+    // blocks are decoded and written one at a time. stored blocks are copied without decoding when they can be.
+    bool ok = true;
+    while (ok && !decoder.Done()) {
+        if (Cancelled(options.cancel)) {
+            std::cerr << "Decompression cancelled\n";
+            ok = false;
+            break;
+        }
+        ok = decoder.ReadHeader();
+        if (ok && decoder.CanCopy()) {
+            ok = decoder.Copy(out);
+        } else if (ok) {
+            ok = decoder.Decode() && out.WriteSparse(decoder.Data(), decoder.BlockSize(), decoder.ZeroRuns());
+        }
+        if (ok && options.progress) options.progress(decoder.Position(), decoder.Size());
+    }
+    ok = out.Close() && ok;
+    if (!ok) {
+        std::cerr << "Failed to decompress " << input_path << "\n";
+        return;
+    }
+    std::cout << "Decompressed " << decoder.Position() << " bytes.\n";
 }
@@ -1,5 +1,173 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <memory>
 
-void Compress(const std::string& input_path, const std::string& output_path);
-void Decompress(const std::string& input_path, const std::string& output_path);
+// called after every block with how many bytes of the original data are done so far, out of 'total'
+// (UINT64_MAX when a streaming frame read from a pipe doesn't say). calls can come from any worker thread,
+// but never two at once.
+using ProgressCallback = std::function<void(uint64_t done, uint64_t total)>;
+
+class CompressionCache;
+class Dictionary;
+struct FrameHeader;
+
+struct CompressOptions {
+    // number of threads used to parse the input. the block is cut into this many chunks,
+    // each of which can still reference everything before it.
+    int threads = 1;
+
+    // 1 (fastest) to 9 (best ratio). bounds how many candidates the match finder tries per position,
+    // so compression time stays linear in the input size at every level.
+    int level = 6;
+
+    // split the input into independent blocks of this many bytes (0 = one block for the whole file).
+    // blocks are spread across the threads, each with its own literal model.
+    int block_size = 0;
+
+    // let each block's match finder see this many raw bytes from the end of the previous block.
+    // the decoder has just produced them, so it costs nothing there, and small blocks keep most of their ratio.
+    int prime_size = 0;
+
+    // store a checkpoint inside each block every this many bytes (0 = none), so a range read can start
+    // decoding near the bytes it wants instead of at the start of the block. matches can't reach back
+    // across a checkpoint, and blocks aren't primed when checkpoints are on.
+    int checkpoint_size = 0;
+
+    // optional progress report, see ProgressCallback.
+    ProgressCallback progress;
+
+    // optional cancellation token. it's checked before every block, so setting it stops the work
+    // once the blocks in flight are done. a cancelled Compress writes no output, and a cancelled
+    // CompressBuffer returns an empty buffer.
+    const std::atomic<bool>* cancel = nullptr;
+
+    // optional on-disk cache (see compression_cache.h). Compress and CompressBuffer return the cached
+    // output for an input they've seen with the same options, and add what they compress otherwise.
+    CompressionCache* cache = nullptr;
+
+    // word-transform blocks that look like text before parsing them (see text_transform.h).
+    // such blocks are parsed both ways and the smaller result is kept. it's off for blocks with checkpoints.
+    bool text = false;
+
+    // split blocks of json records into streams of structure, keys, strings and numbers before parsing
+    // them (see json_transform.h). it takes precedence over 'text' for blocks that look like json.
+    bool json = false;
+
+    // optional dictionary (see dictionary.h) that every block can reference as if it came right before it.
+    // the same one has to be given to decompress. priming is off with a dictionary.
+    const Dictionary* dictionary = nullptr;
+};
+
+struct DecompressOptions {
+    // threads used to decode a block. with more than one, the extra threads decode the literals
+    // in the background while the tokens are run; blocks big enough to have been entropy coded
+    // in several segments can keep more than one of them busy.
+    int threads = 1;
+
+    // leave long zero runs out of the output file as holes instead of writing them.
+    // restoring VM images and database files gets faster and takes less disk.
+    bool sparse = false;
+
+    // same as in CompressOptions. a cancelled Decompress leaves the blocks it got through in the output
+    // file, and DecompressBuffer returns false.
+    ProgressCallback progress;
+    const std::atomic<bool>* cancel = nullptr;
+
+    // the dictionary the data was compressed with, if it was. decompressing fails without it.
+    const Dictionary* dictionary = nullptr;
+};
+
+void Compress(const std::string& input_path, const std::string& output_path, const CompressOptions& options = {});
+void Decompress(const std::string& input_path, const std::string& output_path, const DecompressOptions& options = {});
+
+// in-memory versions of the above. DecompressBuffer returns false on corrupt input.
+std::vector<uint8_t> CompressBuffer(const std::vector<uint8_t>& data, const CompressOptions& options = {});
+bool DecompressBuffer(const std::vector<uint8_t>& compressed, std::vector<uint8_t>& output,
+                      const DecompressOptions& options = {});
+
+// decompresses just the original bytes [offset, offset + length). only the blocks that overlap the range
+// are decoded, each from the nearest checkpoint before it (see CompressOptions::checkpoint_size).
+// primed files have to be decoded from the start.
+void DecompressRange(const std::string& input_path, const std::string& output_path, uint64_t offset,
+                     uint64_t length, const Dictionary* dictionary = nullptr);
+bool DecompressRange(const std::vector<uint8_t>& compressed, uint64_t offset, uint64_t length,
+                     std::vector<uint8_t>& out, const Dictionary* dictionary = nullptr);
+
+// the non-blocking push/pull api, for callers that can't sit inside Compress or Decompress (event loops).
+// it works like zlib's: every call reads what it can from next_in and writes what it can to next_out,
+// moving them along and counting down avail_in and avail_out. everything else lives in a context object.
+struct StreamBuffers {
+    const uint8_t* next_in = nullptr;
+    size_t avail_in = 0;
+    uint8_t* next_out = nullptr;
+    size_t avail_out = 0;
+};
+
+enum class StreamStatus {
+    kNeedInput,  // all the input has been used. call again with more
+    kNeedOutput, // the output is full. call again with more room
+    kContinue,   // stopped early to keep the call short. call again, input and output as they are
+    kEnd,        // the whole frame is through
+    kError,      // corrupt input. the context can't be used any more
+};
+
+// compresses into a streaming frame (see format.h), a block at a time as the input comes in.
+// blocks are options.block_size bytes, or 128 KiB without one. the call that completes a block compresses
+// all of it there and then, so that call takes as long as CompressBuffer on a block (twice that with
+// options.text, which parses it both ways): around 10-30 ms for the default block at the default level,
+// and in proportion for bigger ones. every other call only copies bytes. a call compresses at most one block
+// and returns kContinue if the input holds another, so an event loop gets control back between blocks.
+class CompressContext {
+public:
+    explicit CompressContext(const CompressOptions& options = {});
+    // 'finish' says no more input is coming: the last block is compressed and the frame closed,
+    // and kEnd comes back once all of it has been written out.
+    StreamStatus Process(StreamBuffers& buffers, bool finish = false);
+
+private:
+    CompressOptions options;
+    int block_size;
+    int prime_size;
+    // the primed history ('history' bytes) followed by the input for the next block.
+    std::vector<uint8_t> data;
+    size_t history = 0;
+    // compressed bytes that didn't fit in the caller's output yet.
+    std::vector<uint8_t> out;
+    size_t out_pos = 0;
+    bool started = false;
+    bool finished = false;
+
+    void CompressPending();
+};
+
+// decompresses any .mido frame fed to it in pieces. a block is decoded once all of it has arrived,
+// then handed out as the output allows.
+class DecompressContext {
+public:
+    explicit DecompressContext(const DecompressOptions& options = {});
+    ~DecompressContext();
+    StreamStatus Process(StreamBuffers& buffers);
+
+private:
+    DecompressOptions options;
+    // kept behind a pointer so this header doesn't need format.h.
+    std::unique_ptr<FrameHeader> frame;
+    const Dictionary* dictionary = nullptr;
+    bool have_frame = false;
+    // the frame header or the block being gathered.
+    std::vector<uint8_t> in;
+    // the primed history followed by the last block decoded, handed out from out_pos.
+    std::vector<uint8_t> window;
+    size_t out_pos = 0;
+    uint64_t position = 0;
+    uint32_t blocks_done = 0;
+    bool done = false;
+    bool failed = false;
+
+    bool Wanted(size_t& need);
+    bool Step();
+};
@@ -0,0 +1,152 @@
+#include "dictionary.h"
+#include "file_io.h"
+#include "format.h"
+#include "hash.h"
+#include "match_finder.h"
+#include "rans.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr uint32_t kDictMagic = 0x4D494444; // "MIDD"
+constexpr uint32_t kDictVersion = 2;
+constexpr size_t kDictHeaderSize = 32;
+
+// the sections are mapped in place, so each one starts where an int32 (or the rans table) can be read.
+constexpr size_t kSectionAlign = 8;
+
+static size_t Align(size_t n) {
+    return (n + kSectionAlign - 1) / kSectionAlign * kSectionAlign;
+}
+
+// where the sections are, for a given content size and table size.
+struct DictLayout {
+    size_t content, head, prev, model, rans_table, end;
+
+    DictLayout(size_t content_size, size_t head_count, size_t table_size) {
+        content = kDictHeaderSize;
+        head = Align(content + content_size);
+        prev = Align(head + head_count * sizeof(int32_t));
+        model = Align(prev + content_size * sizeof(int32_t));
+        rans_table = Align(model + 512);
+        end = rans_table + table_size;
+    }
+};
+
+Dictionary::~Dictionary() {
+    if (mapping) munmap(mapping, mapping_size);
+}
+
+bool Dictionary::Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        std::cerr << "Failed to open dictionary: " << path << "\n";
+        return false;
+    }
+    mapping_size = st.st_size;
+    mapping = mapping_size >= kDictHeaderSize ? mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        std::cerr << "Invalid dictionary: " << path << "\n";
+        return false;
+    }
+
+    // everything is checked once here, so the compressor and decoder can use the tables as they are.
+    const uint8_t* p = (const uint8_t*)mapping;
+    id = GetU32(p + 8);
+    content_size = GetU32(p + 12);
+    size_t head_count = GetU32(p + 16);
+    size_t table_size = GetU32(p + 20);
+    uint64_t checksum = GetU32(p + 24) | ((uint64_t)GetU32(p + 28) << 32);
+    // a dictionary made by a build with a different hash table or rans table layout would just be wrong.
+    bool ok = GetU32(p) == kDictMagic && GetU32(p + 4) == kDictVersion && id != 0 && content_size > 0 &&
+              content_size <= kMaxDictionarySize && head_count == kMatchHashBuckets &&
+              table_size == RansTableSize();
+    DictLayout layout(content_size, head_count, table_size);
+    ok = ok && layout.end == mapping_size &&
+         ContentHash(p + kDictHeaderSize, mapping_size - kDictHeaderSize) == checksum;
+    if (ok) {
+        content = p + layout.content;
+        head = (const int32_t*)(p + layout.head);
+        prev = (const int32_t*)(p + layout.prev);
+        model = p + layout.model;
+        rans_table = p + layout.rans_table;
+        // the chains are followed without bounds checks, so every link has to point backwards into the content.
+        for (size_t h = 0; h < head_count && ok; ++h) ok = head[h] >= -1 && head[h] < (int64_t)content_size;
+        for (size_t i = 0; i < content_size && ok; ++i) ok = prev[i] >= -1 && prev[i] < (int64_t)i;
+    }
+    if (!ok) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        std::cerr << "Invalid dictionary: " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool BuildDictionary(const std::vector<uint8_t>& samples, const std::string& path) {
+    if (samples.empty()) {
+        std::cerr << "No samples to build a dictionary from\n";
+        return false;
+    }
+    size_t size = std::min(samples.size(), kMaxDictionarySize);
+    std::vector<uint8_t> content(samples.end() - size, samples.end());
+
+    // the chains as a match finder would have them after inserting the whole content.
+    MatchFinder finder(content, 0, kMaxDictionarySize, GetMatchParams(1));
+    finder.Insert(0, size);
+
+    // the model counts the content plus every byte value once, so it can code any block's literals.
+    std::vector<uint8_t> counted = content;
+    for (int i = 0; i < 256; ++i) counted.push_back(i);
+    RansEncoder rans;
+    rans.BuildModel(counted);
+    std::vector<uint8_t> model = rans.GetModelData();
+    std::vector<uint8_t> table;
+    BuildRansTable(model, table);
+
+    DictLayout layout(size, finder.Head().size(), table.size());
+    std::vector<uint8_t> out(layout.end, 0);
+    std::memcpy(out.data() + layout.content, content.data(), size);
+    std::memcpy(out.data() + layout.head, finder.Head().data(), finder.Head().size() * sizeof(int32_t));
+    std::memcpy(out.data() + layout.prev, finder.Prev().data(), size * sizeof(int32_t));
+    std::memcpy(out.data() + layout.model, model.data(), model.size());
+    std::memcpy(out.data() + layout.rans_table, table.data(), table.size());
+
+    uint32_t id = (uint32_t)ContentHash(content.data(), size);
+    std::vector<uint8_t> header;
+    PutU32(header, kDictMagic);
+    PutU32(header, kDictVersion);
+    PutU32(header, id != 0 ? id : 1);
+    PutU32(header, size);
+    PutU32(header, finder.Head().size());
+    PutU32(header, table.size());
+    uint64_t checksum = ContentHash(out.data() + kDictHeaderSize, out.size() - kDictHeaderSize);
+    PutU32(header, (uint32_t)checksum);
+    PutU32(header, (uint32_t)(checksum >> 32));
+    std::memcpy(out.data(), header.data(), header.size());
+
+    // processes may have the old file mapped, and truncating it under them would kill them with SIGBUS
+    // (or change chains they already checked). so the new file is written next to it and renamed over it,
+    // which leaves their mapping on the old inode.
+    static std::atomic<int> counter{0};
+    std::string temp = path + ".tmp-" + std::to_string(getpid()) + "-" + std::to_string(counter++);
+    OutputFile file;
+    bool ok = file.Open(temp) && file.Write(out.data(), out.size());
+    ok = file.Close() && ok;
+    if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+        unlink(temp.c_str());
+        std::cerr << "Failed to write dictionary: " << path << "\n";
+        return false;
+    }
+    return true;
+}
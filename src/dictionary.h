@@ -0,0 +1,62 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// a dictionary is sample content that every block of a frame may reference as if it came right before
+// the block, which is what lets small inputs find matches at all. its file carries everything
+// a compressor or decompressor would otherwise build from the content at startup:
+//
+// header:   [magic] [version] [id] [content_size] [head_count] [table_size] [checksum (u64)]
+// sections: [content] [head] [prev] [model] [rans table], each starting on an 8-byte boundary
+//
+// head and prev are the match finder's hash chains over the content (see MatchFinder::Load), model is
+// a literal model in the usual 512-byte form and the rans table its decode table (see BuildRansTable).
+// the chains and the table are in this machine's byte order, everything else is little-endian.
+//
+// the file is mapped read-only, so opening one takes no time to speak of, and every process using
+// the same dictionary shares its pages in the page cache. that's also why a dictionary file is only ever
+// replaced (see BuildDictionary), never rewritten in place: processes that have it mapped keep the old one.
+
+// matches reach back at most this far, so content beyond it could never be referenced.
+constexpr size_t kMaxDictionarySize = 32768;
+
+class Dictionary {
+public:
+    Dictionary() = default;
+    ~Dictionary();
+    Dictionary(const Dictionary&) = delete;
+    Dictionary& operator=(const Dictionary&) = delete;
+
+    // maps a dictionary file and checks it. returns false (and says why) if it's unusable.
+    bool Open(const std::string& path);
+
+    // identifies the content. frames compressed with the dictionary record it, and never 0.
+    uint32_t Id() const { return id; }
+    const uint8_t* Content() const { return content; }
+    size_t Size() const { return content_size; }
+    const int32_t* Head() const { return head; }
+    const int32_t* Prev() const { return prev; }
+    // the literal model, and the decode table built from it.
+    std::vector<uint8_t> Model() const { return std::vector<uint8_t>(model, model + kModelSize); }
+    const uint8_t* RansTable() const { return rans_table; }
+
+private:
+    static constexpr size_t kModelSize = 512;
+
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    uint32_t id = 0;
+    size_t content_size = 0;
+    const uint8_t* content = nullptr;
+    const int32_t* head = nullptr;
+    const int32_t* prev = nullptr;
+    const uint8_t* model = nullptr;
+    const uint8_t* rans_table = nullptr;
+};
+
+// writes a dictionary made from 'samples' to 'path'. if there are more than kMaxDictionarySize bytes,
+// the most recent ones are kept. an existing file at 'path' is replaced with a rename, so whoever has it
+// open or mapped keeps reading the old dictionary.
+bool BuildDictionary(const std::vector<uint8_t>& samples, const std::string& path);
@@ -0,0 +1,169 @@
+#include "file_io.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// holes are allocated in whole filesystem blocks, so anything smaller than this just gets written.
+constexpr size_t kHoleGranularity = 4096;
+
+// buffer size for the copy loop when the kernel can't move the data for us.
+constexpr size_t kCopyBufferSize = 1 << 16;
+
+InputFile::~InputFile() {
+    if (fd >= 0) close(fd);
+}
+
+bool InputFile::Open(const std::string& path) {
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    offset = 0;
+    return true;
+}
+
+bool InputFile::Read(void* p, size_t len) {
+    uint8_t* dst = (uint8_t*)p;
+    while (len > 0) {
+        ssize_t n = read(fd, dst, len);
+        if (n <= 0) return false;
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool InputFile::ReadAll(std::vector<uint8_t>& out) {
+    uint8_t buf[kCopyBufferSize];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) return false;
+        if (n == 0) return true;
+        out.insert(out.end(), buf, buf + n);
+        offset += n;
+    }
+}
+
+bool InputFile::ReadAt(uint64_t at, void* p, size_t len) const {
+    uint8_t* dst = (uint8_t*)p;
+    while (len > 0) {
+        ssize_t n = pread(fd, dst, len, at);
+        if (n <= 0) return false;
+        dst += n;
+        len -= n;
+        at += n;
+    }
+    return true;
+}
+
+bool InputFile::Seek(uint64_t to) {
+    if (seekable) {
+        if (lseek(fd, to, SEEK_SET) < 0) return false;
+        offset = to;
+        return true;
+    }
+    // a pipe can only be read forwards, so skipping means reading and throwing it away.
+    if (to < offset) return false;
+    uint8_t buf[kCopyBufferSize];
+    while (offset < to) {
+        if (!Read(buf, std::min<uint64_t>(sizeof(buf), to - offset))) return false;
+    }
+    return true;
+}
+
+OutputFile::~OutputFile() {
+    if (fd >= 0) close(fd);
+}
+
+bool OutputFile::Open(const std::string& path) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    offset = 0;
+    has_holes = false;
+    return fd >= 0;
+}
+
+bool OutputFile::Write(const void* p, size_t len) {
+    const uint8_t* src = (const uint8_t*)p;
+    while (len > 0) {
+        ssize_t n = write(fd, src, len);
+        if (n < 0) return false;
+        src += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool OutputFile::Skip(size_t len) {
+    // the file was just truncated, so seeking past the zeros is enough to leave them unallocated.
+    // if the output is a pipe we can't seek and the zeros get written after all.
+    if (lseek(fd, len, SEEK_CUR) >= 0) {
+        offset += len;
+        has_holes = true;
+        return true;
+    }
+    static const uint8_t zeros[kHoleGranularity] = {};
+    while (len > 0) {
+        size_t n = std::min(len, sizeof(zeros));
+        if (!Write(zeros, n)) return false;
+        len -= n;
+    }
+    return true;
+}
+
+bool OutputFile::WriteSparse(const uint8_t* p, size_t len, const std::vector<ZeroRun>& zero_runs) {
+    size_t pos = 0;
+    for (const ZeroRun& run : zero_runs) {
+        // only the pages entirely inside the run can become a hole.
+        uint64_t run_begin = offset - pos + run.offset;
+        uint64_t hole_begin = (run_begin + kHoleGranularity - 1) / kHoleGranularity * kHoleGranularity;
+        uint64_t hole_end = (run_begin + run.length) / kHoleGranularity * kHoleGranularity;
+        if (hole_end <= hole_begin) continue;
+
+        size_t rel_begin = hole_begin - (offset - pos);
+        size_t rel_end = hole_end - (offset - pos);
+        if (rel_begin < pos) continue;
+        if (!Write(p + pos, rel_begin - pos) || !Skip(rel_end - rel_begin)) return false;
+        pos = rel_end;
+    }
+    return Write(p + pos, len - pos);
+}
+
+bool OutputFile::CopyFrom(InputFile& in, size_t len) {
+#ifdef __linux__
+    // file to file: copy_file_range, which can even share extents on filesystems that support it.
+    // anything involving a pipe: splice. both advance the file positions themselves.
+    bool use_splice = false;
+    while (len > 0) {
+        ssize_t n = use_splice ? splice(in.Fd(), nullptr, fd, nullptr, len, SPLICE_F_MOVE)
+                               : copy_file_range(in.Fd(), nullptr, fd, nullptr, len, 0);
+        if (n < 0 && !use_splice) {
+            use_splice = true;
+            continue;
+        }
+        if (n <= 0) break;
+        len -= n;
+        offset += n;
+        // the kernel moved the input position, keep our count in step with it.
+        in.offset += n;
+    }
+    if (len == 0) return true;
+#endif
+    uint8_t buf[kCopyBufferSize];
+    while (len > 0) {
+        size_t n = std::min(len, sizeof(buf));
+        if (!in.Read(buf, n) || !Write(buf, n)) return false;
+        len -= n;
+    }
+    return true;
+}
+
+bool OutputFile::Close() {
+    bool ok = true;
+    if (has_holes) ok = ftruncate(fd, offset) == 0;
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+    return ok;
+}
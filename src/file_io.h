@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// a stretch of output that is known to be all zeros, e.g. because it came from a run token.
+struct ZeroRun {
+    size_t offset;
+    size_t length;
+};
+
+// thin wrappers over posix file descriptors. they exist so blocks that are stored as-is
+// can move between files (or pipes) inside the kernel instead of through our buffers.
+
+class InputFile {
+public:
+    ~InputFile();
+
+    bool Open(const std::string& path);
+    // reads exactly 'len' bytes, or returns false.
+    bool Read(void* p, size_t len);
+    // reads everything that's left.
+    bool ReadAll(std::vector<uint8_t>& out);
+    // reads at an absolute offset without moving the read position. seekable inputs only.
+    bool ReadAt(uint64_t offset, void* p, size_t len) const;
+    // moves the read position. pipes can only skip forward.
+    bool Seek(uint64_t offset);
+
+    bool Seekable() const { return seekable; }
+    uint64_t Offset() const { return offset; }
+    int Fd() const { return fd; }
+
+private:
+    int fd = -1;
+    bool seekable = false;
+    uint64_t offset = 0;
+
+    // OutputFile::CopyFrom lets the kernel consume input behind our back and settles up here.
+    friend class OutputFile;
+};
+
+class OutputFile {
+public:
+    ~OutputFile();
+
+    bool Open(const std::string& path);
+    bool Write(const void* p, size_t len);
+    // writes 'len' bytes of 'p', but whole pages inside one of 'zero_runs' are skipped with lseek
+    // instead of written, which leaves holes in the file. run offsets are relative to 'p' and sorted.
+    bool WriteSparse(const uint8_t* p, size_t len, const std::vector<ZeroRun>& zero_runs);
+    // copies the next 'len' bytes of 'in' to the output with copy_file_range or splice where the kernel
+    // allows it, and through a small buffer otherwise.
+    bool CopyFrom(InputFile& in, size_t len);
+    // sets the final length (a trailing hole only exists once the file is extended) and closes.
+    bool Close();
+
+private:
+    int fd = -1;
+    uint64_t offset = 0;
+    bool has_holes = false;
+
+    bool Skip(size_t len);
+};
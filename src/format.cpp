@@ -0,0 +1,119 @@
+#include "format.h"
+
+void PutU32(std::vector<uint8_t>& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) out.push_back((v >> (8 * i)) & 0xFF);
+}
+
+uint32_t GetU32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void WriteFrameHeader(std::vector<uint8_t>& out, const FrameHeader& header) {
+    PutU32(out, kMagic);
+    PutU32(out, header.orig_size);
+    PutU32(out, header.prime_size);
+    PutU32(out, header.num_blocks);
+    PutU32(out, header.dict_id);
+}
+
+bool ReadFrameHeader(const uint8_t* p, FrameHeader& header) {
+    if (GetU32(p) != kMagic) return false;
+    header.orig_size = GetU32(p + 4);
+    header.prime_size = GetU32(p + 8);
+    header.num_blocks = GetU32(p + 12);
+    header.dict_id = GetU32(p + 16);
+    return true;
+}
+
+void WriteBlockHeader(std::vector<uint8_t>& out, const BlockHeader& header) {
+    if (header.stored) {
+        PutU32(out, header.raw_size | kStoredBlock);
+        return;
+    }
+    bool transformed = header.transform != BlockTransform::kNone;
+    PutU32(out, header.raw_size | (transformed ? kTransformedBlock : 0));
+    uint32_t split = header.literal_split == LiteralSplit::kAfterMatch ? kSplitLiterals
+                     : header.literal_split == LiteralSplit::kUtf8    ? kUtf8Literals
+                                                                      : 0;
+    PutU32(out, header.rans_size | split);
+    PutU32(out, header.flags_size | (header.coded_flags ? kCodedFlags : 0));
+    PutU32(out, header.match_size);
+    PutU32(out, header.model_size | (uint32_t)header.builtin_model << kBuiltinModelShift);
+    PutU32(out, header.checkpoints_size);
+    if (transformed) PutU32(out, header.transformed_size | (uint32_t)header.transform << kTransformShift);
+}
+
+bool IsEndOfFrame(const uint8_t* p, size_t available) {
+    return available >= kStoredHeaderSize && GetU32(p) == kEndOfFrame;
+}
+
+size_t BlockHeaderSize(uint32_t first_word) {
+    if (first_word & kStoredBlock) return kStoredHeaderSize;
+    return (first_word & kTransformedBlock) ? kTransformedHeaderSize : kBlockHeaderSize;
+}
+
+bool ReadBlockHeader(const uint8_t* p, size_t available, BlockHeader& header) {
+    if (available < kStoredHeaderSize) return false;
+    uint32_t word = GetU32(p);
+    header = BlockHeader();
+    header.stored = (word & kStoredBlock) != 0;
+    bool transformed = (word & kTransformedBlock) != 0;
+    header.raw_size = word & kMaxBlockSize;
+    // a stored block is never transformed.
+    if (header.stored) return !transformed;
+
+    if (available < BlockHeaderSize(word)) return false;
+    header.rans_size = GetU32(p + 4);
+    switch (header.rans_size & (kSplitLiterals | kUtf8Literals)) {
+    case 0: break;
+    case kSplitLiterals: header.literal_split = LiteralSplit::kAfterMatch; break;
+    case kUtf8Literals: header.literal_split = LiteralSplit::kUtf8; break;
+    default: return false;
+    }
+    header.rans_size &= ~(kSplitLiterals | kUtf8Literals);
+    header.flags_size = GetU32(p + 8);
+    header.coded_flags = (header.flags_size & kCodedFlags) != 0;
+    header.flags_size &= ~kCodedFlags;
+    header.match_size = GetU32(p + 12);
+    header.model_size = GetU32(p + 16);
+    header.builtin_model = (BuiltinModel)(header.model_size >> kBuiltinModelShift);
+    header.model_size &= (1u << kBuiltinModelShift) - 1;
+    header.checkpoints_size = GetU32(p + 20);
+    if (header.literal_split != LiteralSplit::kNone && header.checkpoints_size > 0) return false;
+    // a block with a built-in model doesn't store one of its own.
+    if ((int)header.builtin_model > kBuiltinModelCount) return false;
+    if (header.builtin_model != BuiltinModel::kNone && header.model_size > 0) return false;
+    if (transformed) {
+        uint32_t extra = GetU32(p + 24);
+        header.transform = (BlockTransform)(extra >> kTransformShift);
+        header.transformed_size = extra & kMaxBlockSize;
+        return header.transform == BlockTransform::kWords || header.transform == BlockTransform::kJson;
+    }
+    return true;
+}
+
+void WriteCheckpoints(std::vector<uint8_t>& out, const std::vector<Checkpoint>& checkpoints) {
+    for (const Checkpoint& cp : checkpoints) {
+        PutU32(out, cp.raw_pos);
+        PutU32(out, cp.flag_index);
+        PutU32(out, cp.match_offset);
+        PutU32(out, cp.literal_index);
+        PutU32(out, cp.rans_state);
+        PutU32(out, cp.rans_offset);
+    }
+}
+
+bool ReadCheckpoints(const uint8_t* p, size_t size, std::vector<Checkpoint>& checkpoints) {
+    if (size % kCheckpointSize != 0) return false;
+    checkpoints.resize(size / kCheckpointSize);
+    for (Checkpoint& cp : checkpoints) {
+        cp.raw_pos = GetU32(p);
+        cp.flag_index = GetU32(p + 4);
+        cp.match_offset = GetU32(p + 8);
+        cp.literal_index = GetU32(p + 12);
+        cp.rans_state = GetU32(p + 16);
+        cp.rans_offset = GetU32(p + 20);
+        p += kCheckpointSize;
+    }
+    return true;
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// the .mido container. everything is little-endian.
+// header: [magic] [orig_size] [prime_size] [num_blocks] [dict_id]
+// block:  [raw_size] [rans_size] [flags_size] [match_size] [model_size] [checkpoints_size]
+//         [rans_data] [flags] [matches] [model] [checkpoints]
+// stored: [raw_size | kStoredBlock] [raw bytes]
+// transformed: [raw_size | kTransformedBlock] [rans_size] [flags_size] [match_size] [model_size] [checkpoints_size]
+//         [transformed_size | transform << kTransformShift] then the same payload, which decodes to transformed_size
+//         bytes that the inverse of the transform (see BlockTransform) expands to the block's raw_size bytes.
+// rans_data holds the block's literals as a segmented rans stream, and model the one or more models
+// it is coded with, see rans.h. a block can also divide its literals between several streams (see LiteralSplit):
+// rans_data is then [size] [the main stream, coded as above], then each of the others coded with a model of its own
+// like coded flags (below), all but the last after their [size]. a block with checkpoints never splits them.
+// flags are one raw bit per token, most significant bit first. if kCodedFlags is set in flags_size, those bytes
+// are coded like the literals instead: [model_size] [model] then a segmented rans stream.
+// checkpoints is a (possibly empty) list of Checkpoint records, kCheckpointSize bytes each.
+// if the top bits of model_size name a built-in model (see BuiltinModel), the block stores no model and its literals
+// are coded with that one.
+//
+// a streaming compressor doesn't know how much data is coming. its frame has kUnknownSize for
+// orig_size and num_blocks, and ends with kEndOfFrame where the next block header would be.
+//
+// dict_id is 0, or the id of the dictionary (see dictionary.h) the frame was compressed with. the dictionary
+// is then the history of every block instead of the previous block's tail, and a block with an empty
+// model uses the dictionary's.
+
+constexpr uint32_t kMagic = 0x4D49444F; // "MIDO"
+
+// set in a block's raw_size when the block didn't compress and is kept as-is.
+constexpr uint32_t kStoredBlock = 0x80000000u;
+
+// set in a block's raw_size when the block went through a transform before it was compressed.
+constexpr uint32_t kTransformedBlock = 0x40000000u;
+// the flags take the top two bits of raw_size, which leaves this much for the size itself.
+constexpr uint32_t kMaxBlockSize = kTransformedBlock - 1;
+
+// what a transformed block went through. it takes the top two bits of the transformed size.
+enum class BlockTransform : uint8_t {
+    kNone = 0,
+    kWords = 1, // see text_transform.h
+    kJson = 2,  // see json_transform.h
+};
+constexpr int kTransformShift = 30;
+
+// the literal model compiled into the program (see builtin_models.h) that a block is coded with, if any.
+// it takes the top three bits of model_size.
+enum class BuiltinModel : uint8_t {
+    kNone = 0,
+    kText = 1,
+    kSource = 2,
+    kJson = 3,
+    kX86 = 4,
+    kUtf16 = 5,
+};
+constexpr int kBuiltinModelCount = 5;
+constexpr int kBuiltinModelShift = 29;
+
+// set in a block's flags_size when its flags are coded rather than raw bits.
+constexpr uint32_t kCodedFlags = 0x80000000u;
+
+// how a block divides its literals between streams. each way has a flag in rans_size, and at most one is set.
+enum class LiteralSplit : uint8_t {
+    kNone = 0,
+    // kSplitLiterals: the literal right after every match (or run) goes in a second stream.
+    kAfterMatch = 1,
+    // kUtf8Literals: the literals right after a whole multi-byte utf-8 character go in a second stream,
+    // and the ones inside a character in a third.
+    kUtf8 = 2,
+};
+constexpr uint32_t kSplitLiterals = 0x80000000u;
+constexpr uint32_t kUtf8Literals = 0x40000000u;
+
+constexpr uint32_t kUnknownSize = 0xFFFFFFFFu;
+// a stored block of zero bytes, which is never written otherwise.
+constexpr uint32_t kEndOfFrame = kStoredBlock;
+
+constexpr size_t kFrameHeaderSize = 20;
+constexpr size_t kBlockHeaderSize = 24;
+constexpr size_t kStoredHeaderSize = 4;
+constexpr size_t kTransformedHeaderSize = 28;
+constexpr size_t kMaxBlockHeaderSize = kTransformedHeaderSize;
+constexpr size_t kCheckpointSize = 24;
+
+struct FrameHeader {
+    uint32_t orig_size = 0;
+    uint32_t prime_size = 0;
+    uint32_t num_blocks = 0;
+    uint32_t dict_id = 0;
+
+    bool Streaming() const { return num_blocks == kUnknownSize; }
+    // whether a block of 'raw_size' bytes can follow 'produced' bytes. a streaming frame can't tell.
+    bool BlockFits(uint64_t produced, uint32_t raw_size) const {
+        return Streaming() || (produced <= orig_size && raw_size <= orig_size - produced);
+    }
+};
+
+struct BlockHeader {
+    uint32_t raw_size = 0;
+    bool stored = false;
+    uint32_t rans_size = 0;
+    LiteralSplit literal_split = LiteralSplit::kNone;
+    uint32_t flags_size = 0;
+    bool coded_flags = false;
+    uint32_t match_size = 0;
+    uint32_t model_size = 0;
+    BuiltinModel builtin_model = BuiltinModel::kNone;
+    uint32_t checkpoints_size = 0;
+    BlockTransform transform = BlockTransform::kNone;
+    uint32_t transformed_size = 0;
+
+    size_t HeaderSize() const {
+        if (stored) return kStoredHeaderSize;
+        return transform != BlockTransform::kNone ? kTransformedHeaderSize : kBlockHeaderSize;
+    }
+    uint64_t PayloadSize() const {
+        return stored ? raw_size : (uint64_t)rans_size + flags_size + match_size + model_size + checkpoints_size;
+    }
+};
+
+// a point inside a block where decoding can start without anything before it:
+// matches never reach back past a checkpoint, and it records where every stream is at that point.
+struct Checkpoint {
+    uint32_t raw_pos = 0;       // output position, relative to the block start
+    uint32_t flag_index = 0;    // tokens before this point, i.e. which flag bit comes next
+    uint32_t match_offset = 0;  // byte offset into the match stream
+    uint32_t literal_index = 0; // literals before this point
+    uint32_t rans_state = 0;    // rans decoder state just before literal 'literal_index'
+    uint32_t rans_offset = 0;   // and its read position in rans_data, which is read backwards
+};
+
+void PutU32(std::vector<uint8_t>& out, uint32_t v);
+uint32_t GetU32(const uint8_t* p);
+
+void WriteFrameHeader(std::vector<uint8_t>& out, const FrameHeader& header);
+// 'p' must hold kFrameHeaderSize bytes. returns false if the magic doesn't match.
+bool ReadFrameHeader(const uint8_t* p, FrameHeader& header);
+
+void WriteBlockHeader(std::vector<uint8_t>& out, const BlockHeader& header);
+// whether 'p' (with 'available' bytes) starts with the end marker of a streaming frame.
+bool IsEndOfFrame(const uint8_t* p, size_t available);
+// the first 4 bytes say what kind of block it is, and so how long the header is.
+size_t BlockHeaderSize(uint32_t first_word);
+// returns false if fewer than header.HeaderSize() bytes are available, or the kind makes no sense.
+bool ReadBlockHeader(const uint8_t* p, size_t available, BlockHeader& header);
+
+void WriteCheckpoints(std::vector<uint8_t>& out, const std::vector<Checkpoint>& checkpoints);
+// reads 'size' bytes of checkpoint records. returns false if that isn't a whole number of them.
+bool ReadCheckpoints(const uint8_t* p, size_t size, std::vector<Checkpoint>& checkpoints);
@@ -0,0 +1,6 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// a fast non-cryptographic hash of 'len' bytes (xxh64).
+uint64_t ContentHash(const uint8_t* p, size_t len, uint64_t seed = 0);
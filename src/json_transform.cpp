@@ -0,0 +1,396 @@
+#include "json_transform.h"
+#include <algorithm>
+#include <cstring>
+
+// the tags in the structure stream. outside its strings, json is plain ascii, so they don't clash with it.
+constexpr uint8_t kTagString = 0x80;
+constexpr uint8_t kTagInteger = 0x81;
+constexpr uint8_t kTagNumber = 0x82;
+constexpr uint8_t kTagTrue = 0x83;
+constexpr uint8_t kTagFalse = 0x84;
+constexpr uint8_t kTagNull = 0x85;
+// a byte that would read as a tag. it follows as-is.
+constexpr uint8_t kTagRaw = 0x86;
+// a key id too big for a tag of its own. it follows as a varint, less kShortKeys.
+constexpr uint8_t kTagLongKey = 0x9F;
+// keys below kShortKeys are the tag kTagKey + id.
+constexpr uint8_t kTagKey = 0xA0;
+constexpr size_t kShortKeys = 0x100 - kTagKey;
+
+// ends a number that's kept as text. it can't be part of one.
+constexpr uint8_t kNumberEnd = ' ';
+
+// integers with more digits are kept as text, which leaves their deltas room to spare in an int64.
+constexpr size_t kMaxIntegerDigits = 18;
+
+// a block where more than 1/kMaxRawShare of the bytes need kTagRaw isn't json.
+constexpr size_t kMaxRawShare = 64;
+
+static inline bool IsDigit(uint8_t c) {
+    return (uint8_t)(c - '0') < 10;
+}
+
+static inline bool IsNumberByte(uint8_t c) {
+    return IsDigit(c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+static inline bool IsSpace(uint8_t c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void PutVarint(std::vector<uint8_t>& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out.push_back(v);
+}
+
+static bool GetVarint(const uint8_t*& p, const uint8_t* end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end) return false;
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// reads a number written the one way an integer gets printed: digits with an optional minus in front,
+// no leading zeros and no "-0". anything else has to stay text to come back the same.
+static bool ParseInteger(const uint8_t* s, size_t len, int64_t& value) {
+    bool negative = len > 0 && s[0] == '-';
+    size_t digits = len - negative;
+    const uint8_t* d = s + negative;
+    if (digits == 0 || digits > kMaxIntegerDigits || (d[0] == '0' && (digits > 1 || negative))) return false;
+    int64_t v = 0;
+    for (size_t i = 0; i < digits; ++i) {
+        if (!IsDigit(d[i])) return false;
+        v = v * 10 + (d[i] - '0');
+    }
+    value = negative ? -v : v;
+    return true;
+}
+
+// an int64 takes at most this many bytes in decimal, with its sign.
+constexpr size_t kMaxIntegerText = 20;
+
+// writes 'value' in decimal so that it ends at 'text_end', and returns where it starts.
+static uint8_t* FormatInteger(int64_t value, uint8_t* text_end) {
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    uint8_t* text = text_end;
+    do {
+        *--text = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) *--text = '-';
+    return text;
+}
+
+enum class Token { kPlain, kString, kKey, kNumber, kTrue, kFalse, kNull };
+
+// calls f(token, begin, end) for every token of the block, in order. for a string or a key, [begin, end)
+// is what's between the quotes. a plain token is the single byte at 'begin'.
+template <typename F>
+static void ForEachToken(const uint8_t* p, size_t n, const F& f) {
+    size_t i = 0;
+    while (i < n) {
+        uint8_t c = p[i];
+        if (c == '"') {
+            // the string ends at the first quote that isn't escaped. a raw newline can't be inside one,
+            // so a quote without a partner on its line is just a byte, and the next line starts afresh.
+            size_t j = i + 1;
+            while (j < n && p[j] != '"' && p[j] != '\n') j += p[j] == '\\' ? 2 : 1;
+            if (j < n && p[j] == '"') {
+                size_t k = j + 1;
+                while (k < n && IsSpace(p[k])) k++;
+                f(k < n && p[k] == ':' ? Token::kKey : Token::kString, i + 1, j);
+                i = j + 1;
+                continue;
+            }
+        } else if (c == '-' || IsDigit(c)) {
+            size_t j = i + 1;
+            while (j < n && IsNumberByte(p[j])) j++;
+            f(Token::kNumber, i, j);
+            i = j;
+            continue;
+        } else if (c == 't' && n - i >= 4 && std::memcmp(p + i, "true", 4) == 0) {
+            f(Token::kTrue, i, i + 4);
+            i += 4;
+            continue;
+        } else if (c == 'f' && n - i >= 5 && std::memcmp(p + i, "false", 5) == 0) {
+            f(Token::kFalse, i, i + 5);
+            i += 5;
+            continue;
+        } else if (c == 'n' && n - i >= 4 && std::memcmp(p + i, "null", 4) == 0) {
+            f(Token::kNull, i, i + 4);
+            i += 4;
+            continue;
+        }
+        f(Token::kPlain, i, i + 1);
+        i++;
+    }
+}
+
+// the distinct keys of a block. open addressing over indices into 'keys', which point back at the
+// key's first occurrence in the block.
+class KeyTable {
+public:
+    struct Key {
+        uint32_t offset;
+        uint32_t length;
+        uint32_t count;
+        int32_t id; // index in the key table, or -1 if the key isn't in it
+    };
+
+    explicit KeyTable(const uint8_t* block) : block(block), slots(256, -1) {}
+
+    // the key at 'k', added if it's new.
+    Key& Add(const uint8_t* k, size_t len) {
+        int32_t& slot = Slot(k, len);
+        if (slot < 0) {
+            slot = keys.size();
+            keys.push_back({(uint32_t)(k - block), (uint32_t)len, 0, -1});
+            // keep the table at most half full.
+            if (keys.size() * 2 > slots.size()) Grow();
+            return keys.back();
+        }
+        return keys[slot];
+    }
+
+    // the key at 'k', or null if it was never added.
+    const Key* Find(const uint8_t* k, size_t len) {
+        int32_t slot = Slot(k, len);
+        return slot < 0 ? nullptr : &keys[slot];
+    }
+
+    std::vector<Key>& Keys() { return keys; }
+
+private:
+    const uint8_t* block;
+    std::vector<int32_t> slots;
+    std::vector<Key> keys;
+
+    // fnv-1a.
+    static uint32_t Hash(const uint8_t* k, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i) h = (h ^ k[i]) * 16777619u;
+        return h;
+    }
+
+    int32_t& Slot(const uint8_t* k, size_t len) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = Hash(k, len) & mask;; i = (i + 1) & mask) {
+            if (slots[i] < 0) return slots[i];
+            const Key& key = keys[slots[i]];
+            if (key.length == len && std::memcmp(block + key.offset, k, len) == 0) return slots[i];
+        }
+    }
+
+    void Grow() {
+        slots.assign(slots.size() * 2, -1);
+        size_t mask = slots.size() - 1;
+        for (size_t s = 0; s < keys.size(); ++s) {
+            size_t i = Hash(block + keys[s].offset, keys[s].length) & mask;
+            while (slots[i] >= 0) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+    }
+};
+
+bool JsonTransform(const uint8_t* p, size_t n, std::vector<uint8_t>& out) {
+    // step 1: count the keys, and the bytes that would need escaping.
+    KeyTable table(p);
+    size_t raw = 0;
+    ForEachToken(p, n, [&](Token token, size_t begin, size_t end) {
+        if (token == Token::kKey) table.Add(p + begin, end - begin).count++;
+        if (token == Token::kPlain && p[begin] >= 0x80) raw++;
+    });
+    if (raw > n / kMaxRawShare) return false;
+
+    // step 2: keys that come up more than once get ids, the most frequent ones the one-byte tags.
+    std::vector<KeyTable::Key*> keys;
+    for (KeyTable::Key& key : table.Keys()) {
+        if (key.count >= 2) keys.push_back(&key);
+    }
+    if (keys.empty()) return false;
+    std::sort(keys.begin(), keys.end(), [](const KeyTable::Key* a, const KeyTable::Key* b) {
+        return a->count != b->count ? a->count > b->count : a->offset < b->offset;
+    });
+    for (size_t i = 0; i < keys.size(); ++i) keys[i]->id = i;
+
+    // step 3: split the block into its streams.
+    std::vector<uint8_t> structure, strings, numbers;
+    structure.reserve(n / 4);
+    strings.reserve(n / 2);
+    // the last integer under every key. the extra one is for integers that come before any key.
+    std::vector<int64_t> previous(keys.size() + 1, 0);
+    size_t context = keys.size();
+    ForEachToken(p, n, [&](Token token, size_t begin, size_t end) {
+        switch (token) {
+        case Token::kKey: {
+            const KeyTable::Key* key = table.Find(p + begin, end - begin);
+            if (key->id >= 0) {
+                context = key->id;
+                if ((size_t)key->id < kShortKeys) {
+                    structure.push_back(kTagKey + key->id);
+                } else {
+                    structure.push_back(kTagLongKey);
+                    PutVarint(structure, key->id - kShortKeys);
+                }
+                break;
+            }
+            // a key that's only used once is written like any other string.
+            [[fallthrough]];
+        }
+        case Token::kString:
+            structure.push_back(kTagString);
+            strings.insert(strings.end(), p + begin, p + end + 1);
+            break;
+        case Token::kNumber: {
+            int64_t value;
+            if (ParseInteger(p + begin, end - begin, value)) {
+                structure.push_back(kTagInteger);
+                uint64_t delta = (uint64_t)value - (uint64_t)previous[context];
+                PutVarint(numbers, (delta << 1) ^ (uint64_t)((int64_t)delta >> 63));
+                previous[context] = value;
+            } else {
+                structure.push_back(kTagNumber);
+                numbers.insert(numbers.end(), p + begin, p + end);
+                numbers.push_back(kNumberEnd);
+            }
+            break;
+        }
+        case Token::kTrue:
+            structure.push_back(kTagTrue);
+            break;
+        case Token::kFalse:
+            structure.push_back(kTagFalse);
+            break;
+        case Token::kNull:
+            structure.push_back(kTagNull);
+            break;
+        case Token::kPlain:
+            if (p[begin] >= 0x80) structure.push_back(kTagRaw);
+            structure.push_back(p[begin]);
+            break;
+        }
+    });
+
+    out.clear();
+    out.reserve(structure.size() + strings.size() + numbers.size() + 64);
+    PutVarint(out, keys.size());
+    for (const KeyTable::Key* key : keys) {
+        PutVarint(out, key->length);
+        out.insert(out.end(), p + key->offset, p + key->offset + key->length);
+    }
+    PutVarint(out, structure.size());
+    PutVarint(out, strings.size());
+    out.insert(out.end(), structure.begin(), structure.end());
+    out.insert(out.end(), strings.begin(), strings.end());
+    out.insert(out.end(), numbers.begin(), numbers.end());
+    // numbers kept as text grow by their tag and end marker, which the keys have to make up for.
+    return out.size() < n;
+}
+
+bool InverseJsonTransform(const uint8_t* p, size_t n, size_t raw_size, std::vector<uint8_t>& out) {
+    const uint8_t* q = p;
+    const uint8_t* const end = p + n;
+
+    struct Key {
+        const uint8_t* text;
+        size_t length;
+    };
+    uint64_t num_keys;
+    // every key takes at least its length byte, which bounds the count before we allocate for it.
+    if (!GetVarint(q, end, num_keys) || num_keys > (uint64_t)(end - q)) return false;
+    std::vector<Key> keys(num_keys);
+    for (Key& key : keys) {
+        uint64_t length;
+        if (!GetVarint(q, end, length) || length > (uint64_t)(end - q)) return false;
+        key = {q, (size_t)length};
+        q += length;
+    }
+
+    uint64_t structure_size, strings_size;
+    if (!GetVarint(q, end, structure_size) || !GetVarint(q, end, strings_size)) return false;
+    if (structure_size > (uint64_t)(end - q) || strings_size > (uint64_t)(end - q) - structure_size) return false;
+    const uint8_t* s = q;
+    const uint8_t* const structure_end = s + structure_size;
+    const uint8_t* str = structure_end;
+    const uint8_t* const strings_end = str + strings_size;
+    const uint8_t* num = strings_end;
+
+    std::vector<int64_t> previous(num_keys + 1, 0);
+    size_t context = num_keys;
+    // the output is written in place, and nothing is written that doesn't fit in it.
+    size_t start = out.size();
+    out.resize(start + raw_size);
+    uint8_t* o = out.data() + start;
+    uint8_t* const o_end = o + raw_size;
+    auto put = [&](const void* from, size_t len) {
+        if ((size_t)(o_end - o) < len) return false;
+        std::memcpy(o, from, len);
+        o += len;
+        return true;
+    };
+    const uint8_t quote = '"';
+    while (s < structure_end) {
+        // the brackets, commas and whitespace between tokens go over as they are.
+        const uint8_t* run = s;
+        while (s < structure_end && *s < 0x80) s++;
+        if (!put(run, s - run)) return false;
+        if (s == structure_end) break;
+
+        uint8_t c = *s++;
+        if (c >= kTagKey || c == kTagLongKey) {
+            uint64_t id = c - kTagKey;
+            if (c == kTagLongKey) {
+                if (!GetVarint(s, structure_end, id) || id >= num_keys) return false;
+                id += kShortKeys;
+            }
+            if (id >= num_keys) return false;
+            context = id;
+            if (!put(&quote, 1) || !put(keys[id].text, keys[id].length) || !put(&quote, 1)) return false;
+        } else if (c == kTagString) {
+            // the string ends at its first quote that isn't escaped, which is one behind an even number
+            // of backslashes. that's the same quote skipping escapes found while it was split off.
+            const uint8_t* e = str;
+            while (true) {
+                e = (const uint8_t*)std::memchr(e, '"', strings_end - e);
+                if (!e) return false;
+                size_t backslashes = 0;
+                while (e - backslashes > str && e[-1 - (ptrdiff_t)backslashes] == '\\') backslashes++;
+                if (backslashes % 2 == 0) break;
+                e++;
+            }
+            if (!put(&quote, 1) || !put(str, e + 1 - str)) return false;
+            str = e + 1;
+        } else if (c == kTagInteger) {
+            uint64_t zigzag;
+            if (!GetVarint(num, end, zigzag)) return false;
+            uint64_t delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+            previous[context] = (int64_t)((uint64_t)previous[context] + delta);
+            uint8_t text[kMaxIntegerText];
+            uint8_t* begin = FormatInteger(previous[context], text + kMaxIntegerText);
+            if (!put(begin, text + kMaxIntegerText - begin)) return false;
+        } else if (c == kTagNumber) {
+            const uint8_t* e = (const uint8_t*)std::memchr(num, kNumberEnd, end - num);
+            if (!e || !put(num, e - num)) return false;
+            num = e + 1;
+        } else if (c == kTagTrue) {
+            if (!put("true", 4)) return false;
+        } else if (c == kTagFalse) {
+            if (!put("false", 5)) return false;
+        } else if (c == kTagNull) {
+            if (!put("null", 4)) return false;
+        } else if (c == kTagRaw) {
+            if (s == structure_end || !put(s, 1)) return false;
+            s++;
+        } else {
+            return false;
+        }
+    }
+    return str == strings_end && num == end && o == o_end;
+}
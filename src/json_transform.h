@@ -0,0 +1,31 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// a reversible transform for json, and newline-delimited json records in particular, run on a block
+// before it's parsed. the block is split into streams that each hold one kind of token, so the parse
+// finds like next to like instead of keys, strings and numbers interleaved:
+//   structure: the block with every token replaced by a one-byte tag. what's left is brackets, commas,
+//              colons and whitespace, which repeat from record to record.
+//   keys:      object keys that come up more than once are replaced by an id into a key table,
+//              the most frequent keys first.
+//   strings:   the contents of string values, each up to and including its closing quote.
+//   numbers:   integers as zigzag varints of their difference to the previous integer under the same key,
+//              which turns counters, ids and timestamps into small repeating deltas. other numbers as text.
+// true, false and null only leave their tag.
+//
+// the transformed block is:
+// [key count (varint)] [keys, each as [length (varint)] [bytes]] [structure size (varint)] [strings size (varint)]
+// [structure] [strings] [numbers]
+//
+// it's a lexer rather than a parser, so anything round-trips, valid json or not. a string can't span a line,
+// which keeps a block that starts in the middle of a record from pairing up the wrong quotes for long.
+
+// transforms the 'n' bytes at 'p' into 'out'. returns false if the block doesn't look like json records,
+// or wouldn't get any smaller.
+bool JsonTransform(const uint8_t* p, size_t n, std::vector<uint8_t>& out);
+
+// undoes JsonTransform, appending the original bytes to 'out'. returns false if 'p' is malformed
+// or doesn't expand to exactly 'raw_size' bytes.
+bool InverseJsonTransform(const uint8_t* p, size_t n, size_t raw_size, std::vector<uint8_t>& out);
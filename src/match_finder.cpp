@@ -0,0 +1,175 @@
+#include "match_finder.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// pulls a cache line in ahead of time. walking the hash chains is mostly waiting on memory,
+// so we ask for the next thing we'll need while we're still busy with the current one.
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)0)
+#endif
+
+constexpr int kHashBits = kMatchHashBits;
+constexpr int kMinMatch = 3;
+constexpr int kMaxMatch = 255;
+
+MatchParams GetMatchParams(int level) {
+    // max_chain, good_length, nice_length, max_insert, prefetch_distance. modelled on the zlib level table:
+    // low levels give up early, high levels dig deep, but none of them is unbounded.
+    // the fast levels spend so little time per position that the bucket has to be requested further ahead.
+    static const MatchParams table[] = {
+        {    4,   4,   8,   4, 8 }, // 1
+        {    8,   4,  16,   8, 8 }, // 2
+        {   16,   8,  32,  16, 4 }, // 3
+        {   32,   8,  64,  64, 4 }, // 4
+        {   64,   8, 128, 255, 2 }, // 5
+        {  128,   8, 128, 255, 2 }, // 6
+        {  256,  16, 192, 255, 1 }, // 7
+        {  512,  32, 255, 255, 1 }, // 8
+        { 1024,  32, 255, 255, 1 }, // 9
+    };
+    level = std::max(1, std::min(9, level));
+    return table[level - 1];
+}
+
+int RunLength(const uint8_t* p, int max_len, uint8_t value) {
+    int len = 0;
+#if defined(__SSE2__)
+    // 16 bytes at a time: compare against the broadcast byte and look for the first lane that differs.
+    const __m128i needle = _mm_set1_epi8((char)value);
+    while (len + 16 <= max_len) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(p + len));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)) ^ 0xFFFF;
+        if (mask != 0) return len + __builtin_ctz(mask);
+        len += 16;
+    }
+#else
+    // no vector unit: same idea with 8-byte words.
+    uint64_t pattern = 0x0101010101010101ull * value;
+    while (len + 8 <= max_len) {
+        uint64_t word;
+        std::memcpy(&word, p + len, 8);
+        uint64_t diff = word ^ pattern;
+        if (diff != 0) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            // the first byte in memory is the lowest one, so the lowest set bit is in the first byte that differs.
+            return len + __builtin_ctzll(diff) / 8;
+#else
+            // on big-endian targets the first byte is the highest, so just look for it.
+            for (int i = 0; i < 8; ++i) {
+                if (p[len + i] != value) return len + i;
+            }
+#endif
+        }
+        len += 8;
+    }
+#endif
+    while (len < max_len && p[len] == value) len++;
+    return len;
+}
+
+MatchFinder::MatchFinder(const std::vector<uint8_t>& data, int history_begin, int window_size, const MatchParams& params)
+    : data(data), history_begin(history_begin), window_size(window_size), params(params),
+      head(1 << kHashBits, -1), prev(window_size, -1) {}
+
+MatchFinder::MatchFinder(const std::vector<uint8_t>& data, int history_begin, int window_size, const MatchParams& params,
+                         const int32_t* saved_head, const int32_t* saved_prev, int count)
+    : data(data), history_begin(history_begin), window_size(window_size), params(params),
+      head(saved_head, saved_head + kMatchHashBuckets), prev(saved_prev, saved_prev + count) {
+    static_assert(sizeof(int) == sizeof(int32_t), "chains are saved as 32-bit positions");
+    prev.resize(window_size, -1);
+}
+
+uint32_t MatchFinder::Hash(int pos) const {
+    uint32_t v = data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+    return (v * 2654435761u) >> (32 - kHashBits);
+}
+
+void MatchFinder::Insert(int begin, int end) {
+    // the last two bytes of the buffer don't have a full 3-byte hash, they can't start a match anyway.
+    end = std::min(end, (int)data.size() - (kMinMatch - 1));
+    for (int pos = begin; pos < end; ++pos) {
+        uint32_t h = Hash(pos);
+        prev[pos & (window_size - 1)] = head[h];
+        head[h] = pos;
+    }
+}
+
+Match MatchFinder::FindLongestMatch(int pos, int end) {
+    // we limit match length to 255 to fit in a single byte.
+    // matches also never run past 'end', so a chunk parsed on its own thread stops exactly where the next one starts.
+    int limit = std::min(end - pos, kMaxMatch);
+    if (limit < kMinMatch || pos + kMinMatch > (int)data.size()) {
+        return {0, 0};
+    }
+
+    // nothing before 'history_begin' is visible to the decoder when it reaches this block.
+    int lowest = std::max(history_begin, pos - window_size + 1);
+    int nice = std::min(params.nice_length, limit);
+
+    uint32_t h = Hash(pos);
+    int cand = head[h];
+    prev[pos & (window_size - 1)] = cand;
+    head[h] = pos;
+
+    // the bucket for a position a little further on. by the time we get there it should be in cache.
+    int ahead = pos + params.prefetch_distance;
+    if (params.prefetch_distance > 0 && ahead + kMinMatch <= (int)data.size()) {
+        PREFETCH(&head[Hash(ahead)]);
+    }
+
+    int best_len = 0;
+    int best_dist = 0;
+    int chain = params.max_chain;
+    bool good = false;
+    const uint8_t* cur = data.data() + pos;
+    for (; cand >= lowest && chain > 0; --chain) {
+        // look up the next candidate first and start fetching its bytes and its chain link,
+        // so those loads overlap with comparing this one.
+        int next = prev[cand & (window_size - 1)];
+        if (next >= lowest) {
+            PREFETCH(data.data() + next + best_len);
+            PREFETCH(&prev[next & (window_size - 1)]);
+        }
+
+        const uint8_t* ref = data.data() + cand;
+        // cheap rejection: a candidate can only beat the best match if it agrees on the byte just past it.
+        if (ref[best_len] == cur[best_len] && ref[0] == cur[0]) {
+            int len = 0;
+            while (len < limit && ref[len] == cur[len]) len++;
+            if (len > best_len) {
+                best_len = len;
+                best_dist = pos - cand;
+                if (len >= nice) break;
+                // once we have a good match, a much longer one is unlikely. search a quarter as hard.
+                if (!good && len >= params.good_length) {
+                    good = true;
+                    chain >>= 2;
+                }
+            }
+        }
+        // chain entries only ever point backwards. anything else is a slot that has been reused.
+        if (next >= cand) break;
+        cand = next;
+    }
+
+    if (best_len < kMinMatch) return {0, 0};
+    return {best_dist, best_len};
+}
+
+void MatchFinder::Skip(int pos, int length) {
+    // 'pos' itself is left out: after a match FindLongestMatch has already inserted it, and a run token
+    // never searched, so its first byte stays out of the chains like the rest of a long run's middle.
+    if (length <= params.max_insert) {
+        Insert(pos + 1, pos + length);
+    } else {
+        // skip-ahead: only the tail of a long match goes in. whatever lies in the middle of it
+        // is also reachable through the match source, so little is lost.
+        Insert(pos + length - kMinMatch, pos + length);
+    }
+}
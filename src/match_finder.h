@@ -0,0 +1,66 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct Match {
+    int distance;
+    int length;
+};
+
+// limits on how much work the match finder may do, picked by compression level.
+// together they bound the work per input byte no matter what the data looks like.
+struct MatchParams {
+    int max_chain;    // candidates examined per position
+    int good_length;  // once a match this long is found, only a quarter of the remaining chain is searched
+    int nice_length;  // stop searching as soon as a match this long turns up
+    int max_insert;   // after a match longer than this, only its last bytes go into the hash table
+    int prefetch_distance; // how many positions ahead to prefetch the hash bucket (0 = no prefetching)
+};
+
+MatchParams GetMatchParams(int level);
+
+// the number of hash buckets. saved chains only fit a finder with the same number.
+constexpr int kMatchHashBits = 15;
+constexpr size_t kMatchHashBuckets = size_t(1) << kMatchHashBits;
+
+// counts how many bytes starting at 'p' equal 'value', looking at no more than 'max_len' of them.
+// vectorised where the target allows, since this runs ahead of the match finder on every repeated byte.
+int RunLength(const uint8_t* p, int max_len, uint8_t value);
+
+// hash-chain match finder over a read-only buffer.
+// every position is hashed on its first 3 bytes and chained to the previous position with the same hash.
+class MatchFinder {
+public:
+    MatchFinder(const std::vector<uint8_t>& data, int history_begin, int window_size, const MatchParams& params);
+    // starts from saved chains instead, as if positions [0, count) had been inserted already.
+    // 'saved_head' has kMatchHashBuckets entries and 'saved_prev' 'count' of them, which have to fit in the window.
+    MatchFinder(const std::vector<uint8_t>& data, int history_begin, int window_size, const MatchParams& params,
+                const int32_t* saved_head, const int32_t* saved_prev, int count);
+
+    // adds positions [begin, end) to the hash chains without searching.
+    // used to prime the window with history before parsing starts.
+    void Insert(int begin, int end);
+
+    // the hash chains, for saving with a dictionary: one head per hash bucket, and one link per window slot.
+    const std::vector<int>& Head() const { return head; }
+    const std::vector<int>& Prev() const { return prev; }
+
+    // finds the longest match for 'pos' that doesn't run past 'end', then inserts 'pos'.
+    Match FindLongestMatch(int pos, int end);
+
+    // moves past a match (or run) starting at 'pos', which it doesn't insert itself. short matches are
+    // inserted in full after 'pos', long ones only get their tail inserted so runs and periodic data
+    // can't make us crawl.
+    void Skip(int pos, int length);
+
+private:
+    const std::vector<uint8_t>& data;
+    int history_begin;
+    int window_size;
+    MatchParams params;
+    std::vector<int> head;
+    std::vector<int> prev;
+
+    uint32_t Hash(int pos) const;
+};
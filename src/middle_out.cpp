@@ -1,31 +1,164 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstdlib>
+#include <algorithm>
 #include "compressor.h"
+#include "compression_cache.h"
+#include "dictionary.h"
+#include "file_io.h"
+#include "bench.h"
+#include "format.h"
+
+constexpr uint64_t kDefaultCacheLimit = 1ull << 30;
 
 void print_usage(const char* prog_name) {
-    std::cerr << "Usage: " << prog_name << " <command> <input_file> <output_file>\n";
+    std::cerr << "Usage: " << prog_name << " <command> <input_file> <output_file> [options]\n";
     std::cerr << "Commands:\n";
     std::cerr << "  -c   Compress\n";
     std::cerr << "  -d   Decompress\n";
+    std::cerr << "  -dict  Build a dictionary (the output) from sample data (the input)\n";
+    std::cerr << "  -bench [options]   Time compression of adversarial inputs\n";
+    std::cerr << "Options:\n";
+    std::cerr << "  -t <n>   Use n threads (default 1)\n";
+    std::cerr << "  -l <n>   Compression level 1-9 (default 6)\n";
+    std::cerr << "  -b <kb>  Compress in independent blocks of kb KiB (default: one block)\n";
+    std::cerr << "  -p <kb>  Prime each block with the last kb KiB of the previous block\n";
+    std::cerr << "  -s       Write zero runs as holes in a sparse file (decompression only)\n";
+    std::cerr << "  -w       Word-transform text before compressing it\n";
+    std::cerr << "  -j       Split JSON records into typed streams before compressing them\n";
+    std::cerr << "  -k <kb>  Store a checkpoint every kb KiB inside each block for range reads\n";
+    std::cerr << "  -r <offset> <length>  Only decompress this byte range\n";
+    std::cerr << "  -D <file>  Compress or decompress with this dictionary\n";
+    std::cerr << "  -v       Report progress on stderr\n";
+    std::cerr << "  -cache <dir>      Reuse earlier results for identical inputs from a cache in dir\n";
+    std::cerr << "  -cache-limit <mb> Keep the cache under mb MiB, dropping the least recently used (default 1024)\n";
+}
+
+// parses a size given in KiB (-b, -p, -k) into 'bytes'. returns false unless it's a plain number that fits a block,
+// which also keeps the multiplication from overflowing.
+static bool ParseKiB(const char* arg, int& bytes) {
+    char* end;
+    unsigned long kib = std::strtoul(arg, &end, 10);
+    if (*arg < '0' || *arg > '9' || *end != '\0' || kib > kMaxBlockSize / 1024) return false;
+    bytes = (int)(kib * 1024);
+    return true;
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
+    if (argc < 2) {
         print_usage(argv[0]);
         return 1;
     }
 
     std::string command = argv[1];
+    bool bench = command == "-bench";
+    if (!bench && argc < 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    CompressOptions options;
+    DecompressOptions decompress_options;
+    bool range = false;
+    uint64_t range_offset = 0;
+    uint64_t range_length = 0;
+    std::string cache_dir;
+    std::string dictionary_path;
+    uint64_t cache_limit = kDefaultCacheLimit;
+    for (int i = bench ? 2 : 4; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "-t" && i + 1 < argc) {
+            options.threads = std::max(1, std::atoi(argv[++i]));
+            decompress_options.threads = options.threads;
+        } else if (opt == "-l" && i + 1 < argc) {
+            options.level = std::atoi(argv[++i]);
+        } else if (opt == "-b" && i + 1 < argc) {
+            if (!ParseKiB(argv[++i], options.block_size)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == "-p" && i + 1 < argc) {
+            if (!ParseKiB(argv[++i], options.prime_size)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == "-s") {
+            decompress_options.sparse = true;
+        } else if (opt == "-v") {
+            options.progress = [](uint64_t done, uint64_t total) {
+                if (total == UINT64_MAX) {
+                    std::cerr << "\r" << done << " bytes" << std::flush;
+                } else {
+                    std::cerr << "\r" << done << " / " << total << " bytes (" << done * 100 / total << "%)"
+                              << (done == total ? "\n" : "") << std::flush;
+                }
+            };
+            decompress_options.progress = options.progress;
+        } else if (opt == "-w") {
+            options.text = true;
+        } else if (opt == "-j") {
+            options.json = true;
+        } else if (opt == "-k" && i + 1 < argc) {
+            if (!ParseKiB(argv[++i], options.checkpoint_size)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (opt == "-cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (opt == "-cache-limit" && i + 1 < argc) {
+            cache_limit = std::strtoull(argv[++i], nullptr, 10) << 20;
+        } else if (opt == "-D" && i + 1 < argc) {
+            dictionary_path = argv[++i];
+        } else if (opt == "-r" && i + 2 < argc) {
+            range = true;
+            range_offset = std::strtoull(argv[++i], nullptr, 10);
+            range_length = std::strtoull(argv[++i], nullptr, 10);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (bench) {
+        return RunAdversarialBench(options) == 0 ? 0 : 1;
+    }
+
+    CompressionCache cache;
+    if (!cache_dir.empty()) {
+        if (!cache.Open(cache_dir, cache_limit)) return 1;
+        options.cache = &cache;
+    }
+
+    Dictionary dictionary;
+    if (!dictionary_path.empty()) {
+        if (!dictionary.Open(dictionary_path)) return 1;
+        options.dictionary = &dictionary;
+        decompress_options.dictionary = &dictionary;
+    }
+
     std::string input_path = argv[2];
     std::string output_path = argv[3];
 
     if (command == "-c") {
         std::cout << "Compressing " << input_path << " to " << output_path << "...\n";
-        Compress(input_path, output_path);
+        Compress(input_path, output_path, options);
     } else if (command == "-d") {
         std::cout << "Decompressing " << input_path << " to " << output_path << "...\n";
-        Decompress(input_path, output_path);
+        if (range) {
+            DecompressRange(input_path, output_path, range_offset, range_length, options.dictionary);
+        } else {
+            Decompress(input_path, output_path, decompress_options);
+        }
+    } else if (command == "-dict") {
+        InputFile in;
+        std::vector<uint8_t> samples;
+        if (!in.Open(input_path) || !in.ReadAll(samples)) {
+            std::cerr << "Failed to open input file: " << input_path << "\n";
+            return 1;
+        }
+        if (!BuildDictionary(samples, output_path)) return 1;
+        std::cout << "Built dictionary " << output_path << " from " << samples.size() << " bytes of samples.\n";
     } else {
         print_usage(argv[0]);
         return 1;
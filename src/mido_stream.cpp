@@ -0,0 +1,75 @@
+#include "mido_stream.h"
+
+bool MidoStreambuf::Open(const std::string& path, const DecompressOptions& options) {
+    setg(nullptr, nullptr, nullptr);
+    buffer_start = 0;
+    failed = !decoder.Open(path, options);
+    return !failed;
+}
+
+bool MidoStreambuf::LoadBlock() {
+    // the get area points right into the decoder's window, so the bytes are never copied.
+    if (!decoder.ReadHeader() || !decoder.Decode()) {
+        failed = true;
+        setg(nullptr, nullptr, nullptr);
+        return false;
+    }
+    char* p = (char*)decoder.Data();
+    buffer_start = decoder.BlockStart();
+    setg(p, p, p + decoder.BlockSize());
+    return true;
+}
+
+MidoStreambuf::int_type MidoStreambuf::underflow() {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    while (!failed && !decoder.Done()) {
+        if (!LoadBlock()) break;
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    }
+    return traits_type::eof();
+}
+
+std::streamsize MidoStreambuf::showmanyc() {
+    // what's left of the current block can be had without decoding anything.
+    if (gptr() < egptr()) return egptr() - gptr();
+    return failed || decoder.Done() ? -1 : 0;
+}
+
+MidoStreambuf::pos_type MidoStreambuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                                               std::ios_base::openmode which) {
+    int64_t base = 0;
+    if (dir == std::ios_base::cur) {
+        base = buffer_start + (gptr() - eback());
+    } else if (dir == std::ios_base::end) {
+        base = decoder.Size();
+    }
+    if (base + off < 0) return pos_type(off_type(-1));
+    return seekpos(pos_type(base + off), which);
+}
+
+MidoStreambuf::pos_type MidoStreambuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    off_type target = pos;
+    if (!(which & std::ios_base::in) || target < 0 || (uint64_t)target > decoder.Size()) {
+        return pos_type(off_type(-1));
+    }
+    // tellg and short hops stay inside the block we already have.
+    uint64_t end = buffer_start + (egptr() - eback());
+    if ((uint64_t)target >= buffer_start && (uint64_t)target <= end) {
+        setg(eback(), eback() + (target - buffer_start), egptr());
+        return pos;
+    }
+
+    setg(nullptr, nullptr, nullptr);
+    failed = !decoder.Seek(target);
+    if (failed) return pos_type(off_type(-1));
+    buffer_start = target;
+    if (decoder.Done()) return pos;
+    if (!LoadBlock()) return pos_type(off_type(-1));
+    setg(eback(), eback() + (target - buffer_start), egptr());
+    return pos;
+}
+
+MidoIStream::MidoIStream(const std::string& path, const DecompressOptions& options) : std::istream(nullptr) {
+    rdbuf(&buf);
+    if (!buf.Open(path, options)) setstate(std::ios_base::failbit);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <istream>
+#include <streambuf>
+#include <string>
+#include "stream_decoder.h"
+
+// a std::streambuf that decompresses a .mido file as it's read, so it can be parsed like any other stream.
+// blocks are decoded one at a time by a StreamDecoder and read straight out of its buffer,
+// and seekg goes through the decoder's block index (see StreamDecoder::Seek).
+class MidoStreambuf : public std::streambuf {
+public:
+    bool Open(const std::string& path, const DecompressOptions& options = {});
+
+protected:
+    int_type underflow() override;
+    std::streamsize showmanyc() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    StreamDecoder decoder;
+    // where eback() is in the original data. with an empty get area, where the next block starts.
+    uint64_t buffer_start = 0;
+    // a block failed to decode, or a seek left the decoder somewhere unknown. reads hit eof from here on.
+    bool failed = false;
+
+    bool LoadBlock();
+};
+
+// an istream over a MidoStreambuf. the stream starts out failed if the file can't be opened.
+class MidoIStream : public std::istream {
+public:
+    explicit MidoIStream(const std::string& path, const DecompressOptions& options = {});
+
+private:
+    MidoStreambuf buf;
+};
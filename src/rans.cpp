@@ -1,84 +1,486 @@
 #include "rans.h"
+#include "format.h"
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <atomic>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
 
 // Constants for rANS
 constexpr uint32_t PROB_BITS = 12; // 12-bit precision for probabilities
 constexpr uint32_t PROB_SCALE = 1 << PROB_BITS;
 constexpr uint32_t RANS_L = 1 << 16; // Lower bound for renormalization
 
+// a single model is stored as 256 u16 frequencies.
+constexpr size_t kSingleModelSize = 512;
+
+// models can be finer than PROB_BITS, which pays off when a few symbols take most of the probability:
+// at 12 bits the likeliest can't get closer than 1/4096 to certainty. anything finer than PROB_BITS is decoded
+// through an alias table of kAliasBuckets buckets, so its tables don't grow with the precision.
+constexpr uint32_t kMaxProbBits = 16;
+constexpr uint32_t kAliasBuckets = 256;
+constexpr uint32_t kAliasBucketBits = 8;
+// the finer models also keep the state higher, since rans loses more to rounding the closer its lower bound is
+// to the probability scale. with 16 bits the state still fits in 32.
+constexpr uint32_t kFineRansL = 1u << 23;
+
+// an alias table decodes about a quarter slower than a direct one, so a finer model has to save this much
+// of what the stream costs at PROB_BITS to be used.
+constexpr double kMinFineGain = 0.01;
+
+// the lower bound of the state of a stream whose models have 'bits' of precision.
+static uint32_t LowerBound(uint32_t bits) {
+    return bits == PROB_BITS ? RANS_L : kFineRansL;
+}
+
+// Normalize's last pass trades a slot between two symbols while that helps. it's rarely needed more than
+// a handful of times, so this only bounds the work.
+constexpr int kMaxNormalizeTrades = 32;
+
+// lloyd iterations per k when clustering spans. it settles in a few, and the last ones rarely move a span.
+constexpr int kClusterIterations = 6;
+
 struct SymbolStats {
     uint32_t freqs[256];
     uint32_t cum_freqs[257];
+    // the frequencies add up to 1 << bits.
+    uint32_t bits = PROB_BITS;
 
     void Count(const std::vector<uint8_t>& data) {
-        std::fill(std::begin(freqs), std::end(freqs), 0);
-        for (uint8_t b : data) freqs[b]++;
-        
-        // Normalize to PROB_SCALE
-        uint64_t total = data.size();
-        if (total == 0) return;
+        uint64_t counts[256] = {};
+        for (uint8_t b : data) counts[b]++;
+        Normalize(counts);
+    }
 
-        uint32_t current_total = 0;
+    // scales 'counts' to frequencies that add up to 1 << 'precision', every symbol that occurs getting at least 1,
+    // with (as good as) the smallest coded size the counts allow. it takes O(n log n) for the n symbols
+    // that occur, however skewed the counts are:
+    // 1. symbols whose share would round down to 0 get 1, and the rest share what that leaves. setting those
+    //    aside can push the next smallest under 1 too, so they're taken smallest first.
+    // 2. the rest get their share rounded down, which leaves less than one per symbol to hand out.
+    //    that goes one at a time to whichever symbol it saves the most bits on, found with a heap.
+    // 3. the rounding in 1. can leave a few symbols a step away from where they'd code best, so the best
+    //    trade of one step between two symbols is made while it saves anything, kMaxNormalizeTrades at most.
+    void Normalize(const uint64_t counts[256], uint32_t precision = PROB_BITS) {
+        bits = precision;
+        std::fill(std::begin(freqs), std::end(freqs), 0);
+        std::array<int, 256> present;
+        int n = 0;
+        uint64_t rest_total = 0;
         for (int i = 0; i < 256; ++i) {
-            if (freqs[i] > 0) {
-                // Ensure at least 1 count if it exists
-                uint64_t scaled = (uint64_t)freqs[i] * PROB_SCALE / total;
-                if (scaled == 0) scaled = 1;
-                freqs[i] = scaled;
+            if (counts[i] == 0) continue;
+            present[n++] = i;
+            rest_total += counts[i];
+        }
+        if (n == 0) return;
+
+        std::sort(present.begin(), present.begin() + n, [&](int a, int b) { return counts[a] < counts[b]; });
+        uint64_t rest_scale = 1u << bits;
+        int rare = 0;
+        while (rare < n && counts[present[rare]] * rest_scale < rest_total) {
+            freqs[present[rare]] = 1;
+            rest_total -= counts[present[rare++]];
+            rest_scale--;
+        }
+        uint32_t left = (1u << bits) - rare;
+        for (int k = rare; k < n; ++k) {
+            int i = present[k];
+            freqs[i] = counts[i] * rest_scale / rest_total;
+            left -= freqs[i];
+        }
+
+        // what one more (or one less) slot for symbol i is worth in bits.
+        auto gain = [&](int i) { return counts[i] * std::log2((double)(freqs[i] + 1) / freqs[i]); };
+        auto loss = [&](int i) {
+            return freqs[i] > 1 ? counts[i] * std::log2((double)freqs[i] / (freqs[i] - 1)) : HUGE_VAL;
+        };
+        std::array<std::pair<double, int>, 256> heap;
+        for (int k = 0; k < n; ++k) heap[k] = {gain(present[k]), present[k]};
+        std::make_heap(heap.begin(), heap.begin() + n);
+        for (; left > 0; --left) {
+            std::pop_heap(heap.begin(), heap.begin() + n);
+            int i = heap[n - 1].second;
+            freqs[i]++;
+            heap[n - 1] = {gain(i), i};
+            std::push_heap(heap.begin(), heap.begin() + n);
+        }
+
+        for (int trade = 0; trade < kMaxNormalizeTrades; ++trade) {
+            int up = present[0];
+            for (int k = 1; k < n; ++k) {
+                if (gain(present[k]) > gain(up)) up = present[k];
             }
-            current_total += freqs[i];
-        }
-
-        // Adjust to sum exactly to PROB_SCALE
-        if (current_total < PROB_SCALE) {
-            freqs[0] += PROB_SCALE - current_total;
-        } else if (current_total > PROB_SCALE) {
-            // Naive adjustment, just subtract from largest or first
-            // For robustness, this should be better, but for now:
-            int i = 0;
-            while (current_total > PROB_SCALE) {
-                if (freqs[i] > 1) {
-                    freqs[i]--;
-                    current_total--;
-                }
-                i = (i + 1) % 256;
+            int down = -1;
+            for (int k = 0; k < n; ++k) {
+                int i = present[k];
+                if (i != up && (down < 0 || loss(i) < loss(down))) down = i;
             }
+            if (down < 0 || gain(up) <= loss(down) * (1 + 1e-12)) break;
+            freqs[up]++;
+            freqs[down]--;
         }
 
+        Accumulate();
+    }
+
+    // fills in cum_freqs from freqs. returns whether they add up to 1 << bits.
+    bool Accumulate() {
         cum_freqs[0] = 0;
         for (int i = 0; i < 256; ++i) {
             cum_freqs[i+1] = cum_freqs[i] + freqs[i];
         }
+        return cum_freqs[256] == 1u << bits;
     }
 };
 
+// what 'counts' cost in bits with 'stats': log2(scale / freq) per symbol. HUGE_VAL if the model lacks one of them.
+static double ModelBits(const uint64_t counts[256], const SymbolStats& stats) {
+    double bits = 0;
+    for (int i = 0; i < 256; ++i) {
+        if (counts[i] == 0) continue;
+        if (stats.freqs[i] == 0) return HUGE_VAL;
+        bits += counts[i] * (stats.bits - std::log2((double)stats.freqs[i]));
+    }
+    return bits;
+}
+
+// one bucket of an alias table. a model finer than PROB_BITS doesn't give every symbol one contiguous run of
+// slots: the slots are cut into kAliasBuckets buckets of equal size, and every bucket holds at most two
+// symbols, the one it's named after below 'divider' and another above. a symbol's slots, in order, are its
+// ranks 0 .. freq - 1, and a slot minus its piece's 'bias' is its rank.
+struct AliasBucket {
+    uint32_t freqs[2];
+    uint32_t bias[2];
+    uint16_t divider;
+    uint8_t symbols[2];
+};
+
+// lays out 'stats' in alias buckets (vose's method, on whole slots). if 'slots' isn't null it also gets the slot
+// of every rank, at cum_freqs[symbol] + rank, which is what the encoder needs.
+static void BuildAlias(const SymbolStats& stats, AliasBucket buckets[kAliasBuckets], uint16_t* slots) {
+    uint32_t size = (1u << stats.bits) / kAliasBuckets;
+    uint32_t left[256];
+    std::array<int, 256> small, large;
+    int num_small = 0, num_large = 0;
+    for (int i = 0; i < 256; ++i) {
+        left[i] = stats.freqs[i];
+        if (left[i] < size) {
+            small[num_small++] = i;
+        } else {
+            large[num_large++] = i;
+        }
+    }
+    // a bucket that's short of its symbol is topped up by one with slots to spare. there's always one,
+    // since the frequencies add up to exactly a bucket per symbol.
+    while (num_small > 0) {
+        int s = small[--num_small];
+        int l = large[num_large - 1];
+        buckets[s] = {{}, {}, (uint16_t)left[s], {(uint8_t)s, (uint8_t)l}};
+        left[l] -= size - left[s];
+        if (left[l] < size) {
+            num_large--;
+            small[num_small++] = l;
+        }
+    }
+    for (int k = 0; k < num_large; ++k) {
+        int l = large[k];
+        buckets[l] = {{}, {}, (uint16_t)size, {(uint8_t)l, (uint8_t)l}};
+    }
+
+    uint32_t rank[256] = {};
+    for (uint32_t b = 0; b < kAliasBuckets; ++b) {
+        AliasBucket& bucket = buckets[b];
+        for (int k = 0; k < 2; ++k) {
+            uint8_t symbol = bucket.symbols[k];
+            uint32_t begin = b * size + (k ? bucket.divider : 0);
+            uint32_t length = k ? size - bucket.divider : bucket.divider;
+            bucket.freqs[k] = stats.freqs[symbol];
+            bucket.bias[k] = begin - rank[symbol];
+            if (slots) {
+                for (uint32_t j = 0; j < length; ++j) slots[stats.cum_freqs[symbol] + rank[symbol] + j] = begin + j;
+            }
+            rank[symbol] += length;
+        }
+    }
+}
+
+// the literal models of a block: one, or several and which of them codes each span (see rans.h).
+struct ModelSet {
+    std::vector<SymbolStats> models = std::vector<SymbolStats>(1);
+    std::vector<uint8_t> spans; // empty with a single model
+
+    size_t Model(size_t symbol) const { return spans.empty() ? 0 : spans[symbol / kModelSpanSize]; }
+    const SymbolStats& At(size_t symbol) const { return models[Model(symbol)]; }
+
+    // a single model at PROB_BITS is its 256 frequencies as u16. anything else is [count | (bits - PROB_BITS) << 4],
+    // then every model as a bitmap of the symbols it has (32 bytes) followed by their frequencies as varints,
+    // then, with more than one model, one byte per span with the model that codes it.
+    std::vector<uint8_t> Write() const {
+        std::vector<uint8_t> out;
+        if (spans.empty() && models[0].bits == PROB_BITS) {
+            for (int i = 0; i < 256; ++i) {
+                uint32_t f = models[0].freqs[i];
+                out.push_back(f & 0xFF);
+                out.push_back((f >> 8) & 0xFF);
+            }
+            return out;
+        }
+        out.push_back(models.size() | (models[0].bits - PROB_BITS) << 4);
+        for (const SymbolStats& stats : models) {
+            size_t bitmap = out.size();
+            out.resize(bitmap + 32, 0);
+            for (int i = 0; i < 256; ++i) {
+                if (stats.freqs[i] == 0) continue;
+                out[bitmap + i / 8] |= 1 << (i % 8);
+                for (uint32_t f = stats.freqs[i];; f >>= 7) {
+                    out.push_back((f & 0x7F) | (f >= 0x80 ? 0x80 : 0));
+                    if (f < 0x80) break;
+                }
+            }
+        }
+        out.insert(out.end(), spans.begin(), spans.end());
+        return out;
+    }
+
+    // returns false if 'data' is malformed: a model that doesn't add up, or a span without a model.
+    bool Read(const std::vector<uint8_t>& data) {
+        spans.clear();
+        if (data.size() == kSingleModelSize) {
+            models.assign(1, SymbolStats());
+            for (int i = 0; i < 256; ++i) models[0].freqs[i] = data[2*i] | (data[2*i+1] << 8);
+            return models[0].Accumulate();
+        }
+        const uint8_t* p = data.data();
+        const uint8_t* end = p + data.size();
+        if (p == end) return false;
+        size_t count = *p & 0x0F;
+        uint32_t bits = PROB_BITS + (*p++ >> 4);
+        if (count == 0 || count > (size_t)kMaxModels || bits > kMaxProbBits || (count == 1 && bits == PROB_BITS)) {
+            return false;
+        }
+        models.assign(count, SymbolStats());
+        for (SymbolStats& stats : models) {
+            stats.bits = bits;
+            if (end - p < 32) return false;
+            const uint8_t* bitmap = p;
+            p += 32;
+            for (int i = 0; i < 256; ++i) {
+                uint32_t f = 0;
+                if ((bitmap[i / 8] >> (i % 8)) & 1) {
+                    // a frequency fits in three bytes.
+                    for (int shift = 0;; shift += 7) {
+                        if (p == end || shift > 14) return false;
+                        f |= (uint32_t)(*p & 0x7F) << shift;
+                        if (!(*p++ & 0x80)) break;
+                    }
+                    if (f == 0) return false;
+                }
+                stats.freqs[i] = f;
+            }
+            if (!stats.Accumulate()) return false;
+        }
+        spans.assign(p, end);
+        for (uint8_t m : spans) {
+            if (m >= models.size()) return false;
+        }
+        return spans.empty() == (count == 1);
+    }
+
+    // the slot of every rank of every model finer than PROB_BITS (see BuildAlias), empty for the others.
+    std::vector<std::vector<uint16_t>> Slots() const {
+        std::vector<std::vector<uint16_t>> slots(models.size());
+        for (size_t m = 0; m < models.size(); ++m) {
+            if (models[m].bits == PROB_BITS) continue;
+            AliasBucket buckets[kAliasBuckets];
+            slots[m].resize(1u << models[m].bits);
+            BuildAlias(models[m], buckets, slots[m].data());
+        }
+        return slots;
+    }
+
+    // what 'symbols' cost in bits with these models, or HUGE_VAL if they can't code them.
+    double Bits(const std::vector<uint8_t>& symbols) const {
+        size_t step = spans.empty() ? std::max<size_t>(symbols.size(), 1) : kModelSpanSize;
+        if (!spans.empty() && spans.size() < (symbols.size() + step - 1) / step) return HUGE_VAL;
+        double bits = 0;
+        for (size_t begin = 0; begin < symbols.size(); begin += step) {
+            uint64_t counts[256] = {};
+            size_t end = std::min(symbols.size(), begin + step);
+            for (size_t i = begin; i < end; ++i) counts[symbols[i]]++;
+            bits += ModelBits(counts, At(begin));
+        }
+        return bits;
+    }
+};
+
+// k-means over the spans of 'symbols', where a span's distance to a cluster is what it would cost to code
+// with the cluster's statistics. k grows one cluster at a time, each new one seeded with the span the others
+// code worst, for as long as the extra model pays for itself. returns the cheapest set of models found,
+// with what it costs in bytes, models and map included.
+static ModelSet ClusterModels(const std::vector<uint8_t>& symbols, double& best_bytes) {
+    size_t num_spans = (symbols.size() + kModelSpanSize - 1) / kModelSpanSize;
+    std::vector<std::array<uint32_t, 256>> histograms(num_spans, std::array<uint32_t, 256>{});
+    for (size_t i = 0; i < symbols.size(); ++i) histograms[i / kModelSpanSize][symbols[i]]++;
+    // the symbols each span has, so the distances only look at those.
+    std::vector<std::vector<uint8_t>> present(num_spans);
+    for (size_t s = 0; s < num_spans; ++s) {
+        for (int c = 0; c < 256; ++c) {
+            if (histograms[s][c]) present[s].push_back(c);
+        }
+    }
+
+    ModelSet best;
+    best_bytes = HUGE_VAL;
+    double previous_bytes = HUGE_VAL;
+    std::vector<uint8_t> assignment(num_spans, 0);
+    std::vector<double> span_bits(num_spans, 0);
+    std::vector<std::array<uint64_t, 256>> sums;
+    auto sum_clusters = [&](size_t k) {
+        sums.assign(k, std::array<uint64_t, 256>{});
+        for (size_t s = 0; s < num_spans; ++s) {
+            for (uint8_t c : present[s]) sums[assignment[s]][c] += histograms[s][c];
+        }
+    };
+
+    for (size_t k = 1; k <= (size_t)kMaxModels && k <= num_spans; ++k) {
+        if (k > 1) {
+            size_t worst = 0;
+            double worst_rate = -1;
+            for (size_t s = 0; s < num_spans; ++s) {
+                size_t length = std::min(kModelSpanSize, symbols.size() - s * kModelSpanSize);
+                if (span_bits[s] / length > worst_rate) {
+                    worst_rate = span_bits[s] / length;
+                    worst = s;
+                }
+            }
+            assignment[worst] = k - 1;
+        }
+        sum_clusters(k);
+        for (int iteration = 0; iteration < kClusterIterations; ++iteration) {
+            // every cluster's statistics, smoothed so a symbol it hasn't seen is expensive rather than impossible.
+            std::vector<std::array<double, 256>> cost(k);
+            for (size_t m = 0; m < k; ++m) {
+                uint64_t total = 0;
+                for (int c = 0; c < 256; ++c) total += sums[m][c];
+                for (int c = 0; c < 256; ++c) {
+                    cost[m][c] = total ? -std::log2((sums[m][c] + 0.5) / (total + 128.0)) : HUGE_VAL;
+                }
+            }
+            // every span moves to the cluster that codes it cheapest.
+            bool changed = false;
+            for (size_t s = 0; s < num_spans; ++s) {
+                size_t nearest = assignment[s];
+                double nearest_bits = HUGE_VAL;
+                for (size_t m = 0; m < k; ++m) {
+                    double bits = 0;
+                    for (uint8_t c : present[s]) bits += histograms[s][c] * cost[m][c];
+                    if (bits < nearest_bits) {
+                        nearest_bits = bits;
+                        nearest = m;
+                    }
+                }
+                span_bits[s] = nearest_bits;
+                changed |= nearest != assignment[s];
+                assignment[s] = nearest;
+            }
+            if (!changed) break;
+            sum_clusters(k);
+        }
+
+        // what this really costs: the quantised models, their size and the map. a cluster that
+        // lost all its spans is dropped.
+        ModelSet candidate;
+        candidate.models.clear();
+        std::vector<uint8_t> index(k);
+        double bits = 0;
+        for (size_t m = 0; m < k; ++m) {
+            if (std::all_of(sums[m].begin(), sums[m].end(), [](uint64_t n) { return n == 0; })) continue;
+            index[m] = candidate.models.size();
+            candidate.models.emplace_back();
+            candidate.models.back().Normalize(sums[m].data());
+            bits += ModelBits(sums[m].data(), candidate.models.back());
+        }
+        if (candidate.models.size() > 1) {
+            candidate.spans.resize(num_spans);
+            for (size_t s = 0; s < num_spans; ++s) candidate.spans[s] = index[assignment[s]];
+        }
+        size_t model_size = candidate.Write().size();
+        double bytes = bits / 8 + model_size;
+        // several models that happen to write exactly kSingleModelSize bytes would read back as one.
+        if (bytes < best_bytes && (candidate.spans.empty() || model_size != kSingleModelSize)) {
+            best_bytes = bytes;
+            best = std::move(candidate);
+        }
+        // another model didn't pay for itself, and the next one won't either.
+        if (bytes >= previous_bytes) break;
+        previous_bytes = bytes;
+    }
+    return best;
+}
+
+// 'set' requantised from what 'symbols' really are at every precision up to kMaxProbBits, keeping the spans.
+// returns the one that codes them in the fewest bytes, models included, with that size in 'best_bytes'.
+// the finer ones are charged kMinFineGain extra for their slower decoding.
+static ModelSet RefineModels(const std::vector<uint8_t>& symbols, const ModelSet& set, double& best_bytes) {
+    ModelSet best;
+    best_bytes = HUGE_VAL;
+    if (!set.spans.empty() && set.spans.size() < (symbols.size() + kModelSpanSize - 1) / kModelSpanSize) return best;
+    std::vector<std::array<uint64_t, 256>> counts(set.models.size(), std::array<uint64_t, 256>{});
+    for (size_t i = 0; i < symbols.size(); ++i) counts[set.Model(i)][symbols[i]]++;
+    // a model nothing is coded with can't be requantised.
+    for (const auto& c : counts) {
+        if (std::all_of(c.begin(), c.end(), [](uint64_t n) { return n == 0; })) return best;
+    }
+    for (uint32_t bits = PROB_BITS; bits <= kMaxProbBits; ++bits) {
+        ModelSet candidate = set;
+        double coded = 0;
+        for (size_t m = 0; m < set.models.size(); ++m) {
+            candidate.models[m].Normalize(counts[m].data(), bits);
+            coded += ModelBits(counts[m].data(), candidate.models[m]);
+        }
+        // a set that happens to write exactly kSingleModelSize bytes would read back as a single model.
+        size_t model_size = candidate.Write().size();
+        if (model_size == kSingleModelSize && !(bits == PROB_BITS && set.spans.empty())) continue;
+        double bytes = coded / 8 + model_size;
+        if (bits > PROB_BITS) bytes /= 1 - kMinFineGain;
+        if (bytes < best_bytes) {
+            best_bytes = bytes;
+            best = std::move(candidate);
+        }
+    }
+    return best;
+}
+
 class RansEncoderImpl {
 public:
     uint32_t state = RANS_L;
     std::vector<uint8_t> buffer;
-    SymbolStats stats;
-
-    void Init() {
-        state = RANS_L;
-        buffer.clear();
-    }
+    ModelSet set;
+    // set.Slots(), kept up to date with 'set'.
+    std::vector<std::vector<uint16_t>> slots = std::vector<std::vector<uint16_t>>(1);
 
     void BuildModel(const std::vector<uint8_t>& data) {
-        stats.Count(data);
+        set = ModelSet();
+        set.models[0].Count(data);
+        slots.assign(1, {});
     }
 
-    void Encode(uint8_t symbol) {
+    // 'slots' is the model's entry in ModelSet::Slots: null when it's PROB_BITS, and every symbol's slots
+    // are one run starting at cum_freqs[symbol].
+    void Encode(uint8_t symbol, const SymbolStats& stats, const uint16_t* slots) {
         uint32_t freq = stats.freqs[symbol];
         uint32_t start = stats.cum_freqs[symbol];
-        
+
         // renormalization:
         // rans works by holding the entire state of the stream in a single integer 'state'.
         // as we encode symbols, this state grows.
         // if it grows too large (overflows), we need to shrink it.
         // we do this by writing the lower bits to the output stream.
         // this keeps the state within a manageable range (between L and H).
-        while (state >= (1u << (31 - PROB_BITS)) * freq) {
+        while (state >= ((LowerBound(stats.bits) >> stats.bits) << 8) * freq) {
             buffer.push_back(state & 0xFF);
             state >>= 8;
         }
@@ -88,7 +490,9 @@ public:
         // x' = floor(x / freq) * scale + (x % freq) + start
         // it effectively "pushes" the symbol onto the state stack, weighted by its probability.
         // symbols with higher frequency increase the state less (better compression).
-        state = ((state / freq) << PROB_BITS) + (state % freq) + start;
+        // with an alias layout the symbol's slots aren't one run, so the rank (x % freq) is looked up instead.
+        uint32_t rank = state % freq;
+        state = ((state / freq) << stats.bits) + (slots ? slots[start + rank] : start + rank);
     }
 
     void Flush() {
@@ -100,89 +504,197 @@ public:
 };
 
 // Pimpl wrappers
-static RansEncoderImpl enc_impl;
-static SymbolStats shared_stats;
-
-void RansEncoder::Init() {
-    enc_impl.Init();
-}
+RansEncoder::RansEncoder() : impl(new RansEncoderImpl()) {}
+RansEncoder::~RansEncoder() = default;
 
 // we need to build the model before we can encode anything
 // this sets up the frequency tables
 void RansEncoder::BuildModel(const std::vector<uint8_t>& data) {
-    enc_impl.BuildModel(data);
+    impl->BuildModel(data);
 }
 
-void RansEncoder::Encode(uint8_t symbol) {
-    enc_impl.Encode(symbol);
+void RansEncoder::BuildModels(const std::vector<uint8_t>& symbols) {
+    double bytes = impl->set.Bits(symbols) / 8 + impl->set.Write().size();
+    if (symbols.size() > kModelSpanSize) {
+        double clustered_bytes;
+        ModelSet clustered = ClusterModels(symbols, clustered_bytes);
+        if (clustered_bytes < bytes) {
+            impl->set = std::move(clustered);
+            bytes = clustered_bytes;
+        }
+    }
+    double refined_bytes;
+    ModelSet refined = RefineModels(symbols, impl->set, refined_bytes);
+    if (refined_bytes < bytes) impl->set = std::move(refined);
+    impl->slots = impl->set.Slots();
 }
 
-void RansEncoder::Flush() {
-    enc_impl.Flush();
+std::vector<uint8_t> RansEncoder::GetModelData() const {
+    return impl->set.Write();
 }
 
-std::vector<uint8_t> RansEncoder::GetOutput() const {
-    // we return the raw buffer which contains the encoded data
-    return enc_impl.buffer;
+bool RansEncoder::SetModel(const std::vector<uint8_t>& model_data) {
+    // a model that didn't read back can't be laid out, but it isn't used either.
+    bool ok = impl->set.Read(model_data);
+    impl->slots = ok ? impl->set.Slots() : std::vector<std::vector<uint16_t>>(impl->set.models.size());
+    return ok;
 }
 
-std::vector<uint8_t> RansEncoder::GetModelData() const {
-    std::vector<uint8_t> model_data;
-    for (int i = 0; i < 256; ++i) {
-        uint32_t f = enc_impl.stats.freqs[i];
-        model_data.push_back(f & 0xFF);
-        model_data.push_back((f >> 8) & 0xFF);
+size_t RansEncoder::Cost(const std::vector<uint8_t>& symbols) const {
+    // the stream ends with a 4-byte state.
+    double bits = impl->set.Bits(symbols);
+    return bits == HUGE_VAL ? SIZE_MAX : (size_t)(bits / 8) + 4;
+}
+
+// runs job(0) .. job(count - 1) on up to 'threads' threads, the calling thread included.
+template <typename Job>
+static void RunJobs(size_t count, int threads, const Job& job) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < count; i = next++) job(i);
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads && (size_t)t < count; ++t) workers.emplace_back(worker);
+    worker();
+    for (auto& w : workers) w.join();
+}
+
+std::vector<uint8_t> RansEncoder::EncodeSegmented(const std::vector<uint8_t>& symbols, size_t segment_size,
+                                                  int threads, const std::vector<size_t>& marks,
+                                                  std::vector<RansCheckpoint>* checkpoints) const {
+    size_t num_segments = std::max<size_t>(1, (symbols.size() + segment_size - 1) / segment_size);
+    std::vector<std::vector<uint8_t>> segments(num_segments);
+    // checkpoint offsets start out relative to their segment and are fixed up once the layout is known.
+    std::vector<RansCheckpoint> marked(marks.size());
+    std::vector<size_t> marked_segment(marks.size(), 0);
+
+    RunJobs(num_segments, threads, [&](size_t s) {
+        size_t begin = symbols.size() * s / num_segments;
+        size_t end = symbols.size() * (s + 1) / num_segments;
+        // every segment starts from a fresh state and only reads our models, so threads share nothing they write to.
+        RansEncoderImpl enc;
+        enc.state = LowerBound(impl->set.models[0].bits);
+        // rans is a "stack-based" entropy coder, meaning it's last-in-first-out (lifo).
+        // to make sure the decoder reads the first symbol first, we must encode them in reverse order.
+        // since we go backwards, the state right after encoding symbol i is exactly
+        // what the decoder holds right before decoding it.
+        auto mark = std::lower_bound(marks.begin(), marks.end(), end);
+        for (size_t i = end; i > begin; --i) {
+            const std::vector<uint16_t>& slots = impl->slots[impl->set.Model(i - 1)];
+            enc.Encode(symbols[i - 1], impl->set.At(i - 1), slots.empty() ? nullptr : slots.data());
+            while (mark != marks.begin() && *(mark - 1) == i - 1) {
+                --mark;
+                marked[mark - marks.begin()] = {enc.state, (uint32_t)enc.buffer.size()};
+                marked_segment[mark - marks.begin()] = s;
+            }
+        }
+        enc.Flush();
+        segments[s] = std::move(enc.buffer);
+    });
+
+    std::vector<uint8_t> out;
+    PutU32(out, num_segments);
+    for (size_t s = 0; s < num_segments; ++s) {
+        PutU32(out, symbols.size() * (s + 1) / num_segments - symbols.size() * s / num_segments);
+        PutU32(out, segments[s].size());
+    }
+    std::vector<size_t> segment_offset(num_segments);
+    for (size_t s = 0; s < num_segments; ++s) {
+        segment_offset[s] = out.size();
+        out.insert(out.end(), segments[s].begin(), segments[s].end());
+    }
+    if (checkpoints) {
+        // a mark past the last symbol has nothing left to decode, so it just keeps an empty checkpoint.
+        for (size_t m = 0; m < marks.size(); ++m) {
+            if (marks[m] < symbols.size()) marked[m].offset += segment_offset[marked_segment[m]];
+        }
+        *checkpoints = std::move(marked);
     }
-    return model_data;
+    return out;
 }
 
-class RansDecoderImpl {
-public:
-    uint32_t state;
-    const std::vector<uint8_t>& data;
-    size_t ptr;
+// the decoding side of a model: read-only once built, so any number of streams can share it.
+struct DecodeTable {
     SymbolStats stats;
+    // at PROB_BITS: slot -> symbol lookup, so finding the symbol is a single load instead of a search.
+    uint8_t slot_to_symbol[PROB_SCALE];
+    // finer than that: the alias buckets, which hold everything Decode needs.
+    AliasBucket buckets[kAliasBuckets];
+
+    // 'model' comes from ModelSet::Read, which checked that it adds up, so Decode can trust every slot.
+    void Build(const SymbolStats& model) {
+        stats = model;
+        if (stats.bits != PROB_BITS) {
+            BuildAlias(stats, buckets, nullptr);
+            return;
+        }
+        for (int i = 0; i < 256; ++i) {
+            std::fill(slot_to_symbol + stats.cum_freqs[i], slot_to_symbol + stats.cum_freqs[i+1], (uint8_t)i);
+        }
+    }
+};
+
+// the tables a stream is decoded with: one for all of it, or one per span.
+struct TableSet {
+    const DecodeTable* single = nullptr;
+    const DecodeTable* tables = nullptr;
+    const uint8_t* spans = nullptr;
+    size_t num_spans = 0;
 
-    RansDecoderImpl(const std::vector<uint8_t>& d) : data(d) {
-        ptr = d.size();
-        state = RANS_L; 
+    // whether there's a table for every span of a stream of 'symbols' symbols.
+    bool Covers(size_t symbols) const {
+        return !spans || num_spans == (symbols + kModelSpanSize - 1) / kModelSpanSize;
+    }
+
+    const DecodeTable& At(size_t symbol) const {
+        return spans ? tables[spans[symbol / kModelSpanSize]] : *single;
+    }
+
+    // all the models of a set have the same precision.
+    uint32_t Lower() const { return LowerBound(single->stats.bits); }
+};
+
+// the state of one encoded stream. the bytes are read from the end backwards.
+struct DecodeStream {
+    uint32_t state = RANS_L;
+    uint32_t lower = RANS_L;
+    const uint8_t* data = nullptr;
+    size_t ptr = 0;
+
+    void Init(const uint8_t* d, size_t size, uint32_t lower_bound) {
+        data = d;
+        ptr = size;
+        lower = lower_bound;
+        state = lower;
         if (ptr >= 4) {
             ptr -= 4;
-            state = data[ptr] | (data[ptr+1] << 8) | (data[ptr+2] << 16) | (data[ptr+3] << 24);
+            state = data[ptr] | (data[ptr+1] << 8) | (data[ptr+2] << 16) | ((uint32_t)data[ptr+3] << 24);
         }
     }
 
-    void Init(const std::vector<uint8_t>& model_data) {
-        if (model_data.size() < 512) return;
-        for (int i = 0; i < 256; ++i) {
-            uint32_t f = model_data[2*i] | (model_data[2*i+1] << 8);
-            stats.freqs[i] = f;
-        }
-        stats.cum_freqs[0] = 0;
-        for (int i = 0; i < 256; ++i) {
-            stats.cum_freqs[i+1] = stats.cum_freqs[i] + stats.freqs[i];
+    uint8_t Decode(const DecodeTable& table) {
+        switch (table.stats.bits) {
+            case 13: return DecodeAlias<13>(table.buckets);
+            case 14: return DecodeAlias<14>(table.buckets);
+            case 15: return DecodeAlias<15>(table.buckets);
+            case 16: return DecodeAlias<16>(table.buckets);
+            default: return DecodeDirect(table);
         }
     }
 
-    uint8_t Decode() {
+    uint8_t DecodeDirect(const DecodeTable& table) {
         // decoding is the reverse of encoding.
         // we start with the final state and "pop" symbols off it.
 
         // step 1: find the symbol.
         // the lower bits of the state tell us which "slot" in the probability table the symbol occupies.
         uint32_t slot = state & (PROB_SCALE - 1);
-        
-        // we search the cumulative frequency table to find which symbol owns this slot.
-        uint8_t symbol = 0;
-        for (int i = 0; i < 256; ++i) {
-            if (slot < stats.cum_freqs[i+1]) {
-                symbol = i;
-                break;
-            }
-        }
 
-        uint32_t freq = stats.freqs[symbol];
-        uint32_t start = stats.cum_freqs[symbol];
+        // the lookup table tells us which symbol owns this slot.
+        uint8_t symbol = table.slot_to_symbol[slot];
+
+        uint32_t freq = table.stats.freqs[symbol];
+        uint32_t start = table.stats.cum_freqs[symbol];
 
         // step 2: update state.
         // we remove the symbol from the state, reversing the encoding formula.
@@ -197,27 +709,290 @@ public:
 
         return symbol;
     }
+
+    // the same with an alias table: the slot's bucket, then which side of the divider it's on,
+    // gives the symbol, its frequency and what turns the slot into its rank.
+    template <uint32_t bits>
+    uint8_t DecodeAlias(const AliasBucket* buckets) {
+        constexpr uint32_t shift = bits - kAliasBucketBits;
+        uint32_t slot = state & ((1u << bits) - 1);
+        const AliasBucket& bucket = buckets[slot >> shift];
+        int k = (slot & ((1u << shift) - 1)) >= bucket.divider;
+        state = (state >> bits) * bucket.freqs[k] + slot - bucket.bias[k];
+        while (state < kFineRansL && ptr > 0) {
+            state = (state << 8) | data[--ptr];
+        }
+        return bucket.symbols[k];
+    }
+
+    // a stream that decoded cleanly has used up every byte and is back where the encoder started.
+    bool Finished() const { return ptr == 0 && state == lower; }
+};
+
+// decodes symbols [begin, end) of a stream into 'out'. the table only changes at span boundaries,
+// so the inner loop is the same as with a single model.
+static void DecodeSymbols(DecodeStream& stream, const TableSet& set, size_t begin, size_t end, uint8_t* out) {
+    for (size_t i = begin; i < end;) {
+        size_t stop = std::min(end, (i / kModelSpanSize + 1) * kModelSpanSize);
+        const DecodeTable& table = set.At(i);
+        // the precision is known for the whole span, so the shifts in the loop are constants.
+        const AliasBucket* buckets = table.buckets;
+        switch (table.stats.bits) {
+            case 13: for (; i < stop; ++i) *out++ = stream.DecodeAlias<13>(buckets); break;
+            case 14: for (; i < stop; ++i) *out++ = stream.DecodeAlias<14>(buckets); break;
+            case 15: for (; i < stop; ++i) *out++ = stream.DecodeAlias<15>(buckets); break;
+            case 16: for (; i < stop; ++i) *out++ = stream.DecodeAlias<16>(buckets); break;
+            default: for (; i < stop; ++i) *out++ = stream.DecodeDirect(table); break;
+        }
+    }
+}
+
+// the table at the front of a segmented stream, checked against the size of the stream.
+struct SegmentTable {
+    std::vector<size_t> symbol_begin;          // first symbol of every segment, plus the total at the end
+    std::vector<const uint8_t*> byte_begin;    // first byte of every segment, plus the end of the stream
+
+    size_t Count() const { return symbol_begin.size() - 1; }
+
+    bool Read(const uint8_t* data, size_t size, size_t max_symbols) {
+        if (size < 4) return false;
+        uint64_t num_segments = GetU32(data);
+        if (num_segments == 0 || num_segments > (size - 4) / 8) return false;
+        symbol_begin.assign(num_segments + 1, 0);
+        byte_begin.assign(num_segments + 1, data + 4 + num_segments * 8);
+        for (size_t s = 0; s < num_segments; ++s) {
+            uint32_t count = GetU32(data + 4 + s * 8);
+            uint32_t bytes = GetU32(data + 8 + s * 8);
+            if (count > max_symbols - symbol_begin[s] || bytes > (size_t)(data + size - byte_begin[s])) return false;
+            symbol_begin[s + 1] = symbol_begin[s] + count;
+            byte_begin[s + 1] = byte_begin[s] + bytes;
+        }
+        return true;
+    }
 };
 
-static RansDecoderImpl* dec_impl = nullptr;
+// the tables are plain data, so a saved one can be used straight from the file.
+static_assert(std::is_trivially_copyable<DecodeTable>::value, "DecodeTable is saved as bytes");
 
-void RansDecoder::Init(const std::vector<uint8_t>& data) {
-    // This signature is now used for passing the compressed stream
-    // We need a separate way to pass the model, or pack it.
-    // Let's assume 'data' contains ONLY the compressed stream for now,
-    // and we add a method SetModel.
-    if (dec_impl) delete dec_impl;
-    dec_impl = new RansDecoderImpl(data);
+size_t RansTableSize() {
+    return sizeof(DecodeTable);
 }
 
-void RansDecoder::SetModel(const std::vector<uint8_t>& model_data) {
-    if (dec_impl) dec_impl->Init(model_data);
+bool BuildRansTable(const std::vector<uint8_t>& model_data, std::vector<uint8_t>& table) {
+    ModelSet set;
+    if (!set.Read(model_data) || !set.spans.empty()) return false;
+    // zeroed first, so the half of the table the model doesn't use is saved as zeros.
+    DecodeTable built = {};
+    built.Build(set.models[0]);
+    table.resize(sizeof(built));
+    std::memcpy(table.data(), &built, sizeof(built));
+    return true;
 }
 
-uint8_t RansDecoder::Decode() {
-    return dec_impl->Decode();
+class RansDecoderImpl {
+public:
+    DecodeTable own;
+    // either 'own' or a table from SetTable.
+    const DecodeTable* table = &own;
+    // with several models, their tables and which one decodes each span.
+    std::vector<DecodeTable> tables;
+    std::vector<uint8_t> spans;
+
+    TableSet Tables() const {
+        TableSet set;
+        set.single = table;
+        if (!spans.empty()) {
+            set.tables = tables.data();
+            set.spans = spans.data();
+            set.num_spans = spans.size();
+        }
+        return set;
+    }
+};
+
+RansDecoder::RansDecoder() : impl(new RansDecoderImpl()) {}
+RansDecoder::~RansDecoder() = default;
+
+bool RansDecoder::SetModel(const std::vector<uint8_t>& model_data) {
+    ModelSet set;
+    impl->table = &impl->own;
+    impl->tables.clear();
+    impl->spans.clear();
+    if (!set.Read(model_data)) return false;
+    impl->own.Build(set.models[0]);
+    if (!set.spans.empty()) {
+        impl->tables.resize(set.models.size());
+        for (size_t m = 0; m < set.models.size(); ++m) impl->tables[m].Build(set.models[m]);
+        impl->spans = std::move(set.spans);
+    }
+    return true;
 }
 
-void BuildRansModel(const std::vector<uint8_t>& data) {
-    enc_impl.BuildModel(data);
+void RansDecoder::SetTable(const uint8_t* table) {
+    impl->table = reinterpret_cast<const DecodeTable*>(table);
+    impl->tables.clear();
+    impl->spans.clear();
+}
+
+bool RansDecoder::DecodeSegmented(const uint8_t* data, size_t size, size_t max_symbols, std::vector<uint8_t>& out,
+                                  int threads) const {
+    // read the segment table first and check it against the stream, so the workers can't run off either end.
+    SegmentTable segments;
+    TableSet tables = impl->Tables();
+    if (!segments.Read(data, size, max_symbols) || !tables.Covers(segments.symbol_begin.back())) return false;
+
+    out.resize(segments.symbol_begin.back());
+    std::atomic<bool> ok(true);
+    RunJobs(segments.Count(), threads, [&](size_t s) {
+        DecodeStream stream;
+        stream.Init(segments.byte_begin[s], segments.byte_begin[s + 1] - segments.byte_begin[s], tables.Lower());
+        DecodeSymbols(stream, tables, segments.symbol_begin[s], segments.symbol_begin[s + 1],
+                      out.data() + segments.symbol_begin[s]);
+        if (!stream.Finished()) ok = false;
+    });
+    return ok;
+}
+
+// the helpers publish their progress every this many symbols.
+constexpr size_t kPipelineBatch = 4096;
+
+class RansPipelineImpl {
+public:
+    // copies of the decoder's tables, so the helpers don't depend on it.
+    DecodeTable table;
+    std::vector<DecodeTable> tables;
+    std::vector<uint8_t> spans;
+    TableSet set;
+    SegmentTable segments;
+    std::vector<uint8_t> out;
+    // symbols decoded so far in every segment, published with release so the bytes are visible before the count.
+    std::unique_ptr<std::atomic<size_t>[]> progress;
+    std::atomic<size_t> next_segment{0};
+    std::atomic<bool> stop{false};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> workers;
+    size_t current = 0; // the segment the caller is reading from
+
+    void Work() {
+        // segments are handed out in order, which is also the order the caller reads them.
+        for (size_t s = next_segment++; s < segments.Count() && !stop; s = next_segment++) {
+            DecodeStream stream;
+            stream.Init(segments.byte_begin[s], segments.byte_begin[s + 1] - segments.byte_begin[s], set.Lower());
+            size_t begin = segments.symbol_begin[s];
+            size_t end = segments.symbol_begin[s + 1];
+            for (size_t i = begin; i < end;) {
+                size_t batch_end = std::min(end, i + kPipelineBatch);
+                DecodeSymbols(stream, set, i, batch_end, out.data() + i);
+                i = batch_end;
+                if (stop) return;
+                if (i < end) progress[s].store(i - begin, std::memory_order_release);
+            }
+            // the last batch is only published after the check, so Finish sees the verdict.
+            if (!stream.Finished()) failed = true;
+            progress[s].store(end - begin, std::memory_order_release);
+        }
+    }
+};
+
+RansPipeline::RansPipeline() : impl(new RansPipelineImpl()) {}
+
+RansPipeline::~RansPipeline() {
+    impl->stop = true;
+    for (auto& w : impl->workers) w.join();
+}
+
+bool RansPipeline::Start(const RansDecoder& decoder, const uint8_t* data, size_t size, size_t max_symbols,
+                         int threads) {
+    const RansDecoderImpl& from = *decoder.impl;
+    if (!impl->segments.Read(data, size, max_symbols) ||
+        !from.Tables().Covers(impl->segments.symbol_begin.back())) {
+        return false;
+    }
+    impl->table = *from.table;
+    impl->tables = from.tables;
+    impl->spans = from.spans;
+    impl->set = from.Tables();
+    impl->set.single = &impl->table;
+    impl->set.tables = impl->tables.data();
+    impl->set.spans = impl->spans.empty() ? nullptr : impl->spans.data();
+    impl->out.resize(impl->segments.symbol_begin.back());
+    impl->progress.reset(new std::atomic<size_t>[impl->segments.Count()]);
+    for (size_t s = 0; s < impl->segments.Count(); ++s) impl->progress[s] = 0;
+    for (int t = 0; t < std::max(1, threads); ++t) impl->workers.emplace_back(&RansPipelineImpl::Work, impl.get());
+    return true;
+}
+
+const uint8_t* RansPipeline::Data() const {
+    return impl->out.data();
+}
+
+size_t RansPipeline::Size() const {
+    return impl->out.size();
+}
+
+size_t RansPipeline::Wait(size_t have) {
+    const SegmentTable& segments = impl->segments;
+    while (true) {
+        size_t& s = impl->current;
+        while (s < segments.Count() && impl->progress[s].load(std::memory_order_acquire) ==
+                                           segments.symbol_begin[s + 1] - segments.symbol_begin[s]) {
+            s++;
+        }
+        size_t ready = s < segments.Count()
+                           ? segments.symbol_begin[s] + impl->progress[s].load(std::memory_order_acquire)
+                           : Size();
+        if (ready > have || ready == Size()) return ready;
+        // the helpers are at most one batch away, so there's no point in sleeping.
+        std::this_thread::yield();
+    }
+}
+
+bool RansPipeline::Finish() {
+    Wait(Size());
+    return !impl->failed;
+}
+
+bool RansDecoder::DecodeSegmentedRange(const uint8_t* data, size_t size, size_t max_symbols, size_t first,
+                                       size_t count, const RansCheckpoint* from, std::vector<uint8_t>& out) const {
+    SegmentTable segments;
+    TableSet tables = impl->Tables();
+    if (!segments.Read(data, size, max_symbols) || first > segments.symbol_begin.back() ||
+        !tables.Covers(segments.symbol_begin.back())) {
+        return false;
+    }
+    count = std::min(count, segments.symbol_begin.back() - first);
+    out.resize(count);
+    if (count == 0) return true;
+
+    // find the segment holding 'first' and pick the stream up there, either from the checkpoint
+    // or from the segment's own final state.
+    size_t s = std::upper_bound(segments.symbol_begin.begin(), segments.symbol_begin.end(), first) -
+               segments.symbol_begin.begin() - 1;
+    DecodeStream stream;
+    if (from) {
+        const uint8_t* seg = segments.byte_begin[s];
+        if (from->offset < (size_t)(seg - data) || from->offset > (size_t)(segments.byte_begin[s + 1] - data)) {
+            return false;
+        }
+        stream.data = seg;
+        stream.ptr = data + from->offset - seg;
+        stream.state = from->state;
+        stream.lower = tables.Lower();
+    } else {
+        if (segments.symbol_begin[s] != first) return false;
+        stream.Init(segments.byte_begin[s], segments.byte_begin[s + 1] - segments.byte_begin[s], tables.Lower());
+    }
+
+    for (size_t i = first; i < first + count;) {
+        if (i == segments.symbol_begin[s + 1]) {
+            // ran into the next segment, which starts from its own final state.
+            if (!stream.Finished()) return false;
+            while (i == segments.symbol_begin[s + 1]) ++s;
+            stream.Init(segments.byte_begin[s], segments.byte_begin[s + 1] - segments.byte_begin[s], tables.Lower());
+        }
+        size_t stop = std::min(first + count, segments.symbol_begin[s + 1]);
+        DecodeSymbols(stream, tables, i, stop, out.data() + (i - first));
+        i = stop;
+    }
+    return true;
 }
@@ -1,27 +1,115 @@
 #pragma once
 #include <vector>
 #include <cstdint>
+#include <memory>
 
 // rANS Encoder/Decoder
 // This will implement a static probability model rANS for simplicity first.
+//
+// a segmented stream cuts one long run of symbols into pieces that are flushed independently
+// but share one model, so the pieces can be encoded and decoded on different threads:
+// [num_segments] then [symbol_count] [byte_size] for every segment, then the segments back to back.
+// all fields are u32 little-endian.
+//
+// a stream can have several models instead of one: it's cut into spans of kModelSpanSize symbols, and every
+// span is coded with one of up to kMaxModels models, so a block that mixes text, tables and binary doesn't
+// have to code all of it with their average. the model data then says which model codes each span.
+//
+// models usually have 12-bit probabilities. a stream dominated by a few symbols can use up to 16 bits instead,
+// decoded through alias tables that stay the same size whatever the precision.
+
+constexpr size_t kModelSpanSize = 2048;
+constexpr int kMaxModels = 8;
+
+// what the encoder remembers to let a decoder start in the middle of a segmented stream:
+// the decoder's state just before a given symbol, and its read position in the stream at that point.
+struct RansCheckpoint {
+    uint32_t state = 0;
+    uint32_t offset = 0;
+};
+
+class RansEncoderImpl;
+class RansDecoderImpl;
+class RansPipelineImpl;
 
 class RansEncoder {
 public:
-    void Init();
+    RansEncoder();
+    ~RansEncoder();
+
     void BuildModel(const std::vector<uint8_t>& data); // Added
-    void Encode(uint8_t symbol);
-    void Flush();
-    std::vector<uint8_t> GetOutput() const;
+    // clusters the spans of 'symbols' by their statistics and switches to one model per cluster,
+    // if that codes them in fewer bytes than the current model, the extra models and the map included.
+    // then fits the models to 'symbols' at whichever precision codes them best.
+    void BuildModels(const std::vector<uint8_t>& symbols);
     std::vector<uint8_t> GetModelData() const;
-};
+    // uses a model written by GetModelData instead of building one. returns false if it's malformed.
+    bool SetModel(const std::vector<uint8_t>& model_data);
+    // roughly how many bytes 'symbols' take with the current model, or SIZE_MAX if the model can't code them.
+    size_t Cost(const std::vector<uint8_t>& symbols) const;
+    // encodes 'symbols' with the current model as a segmented stream of (roughly) 'segment_size' symbols
+    // per segment, working on up to 'threads' segments at once. the encoder's own state is left alone.
+    // for every (sorted) index in 'marks' a checkpoint is added to 'checkpoints'.
+    std::vector<uint8_t> EncodeSegmented(const std::vector<uint8_t>& symbols, size_t segment_size, int threads,
+                                         const std::vector<size_t>& marks = {},
+                                         std::vector<RansCheckpoint>* checkpoints = nullptr) const;
 
-// Helper function declaration
-void BuildRansModel(const std::vector<uint8_t>& data);
+private:
+    // every encoder owns its own state, so blocks can be encoded on different threads.
+    std::unique_ptr<RansEncoderImpl> impl;
+};
 
 
 class RansDecoder {
 public:
-    void Init(const std::vector<uint8_t>& data);
-    void SetModel(const std::vector<uint8_t>& model_data); // Added
-    uint8_t Decode();
+    RansDecoder();
+    ~RansDecoder();
+
+    // returns false if the table is malformed (its frequencies don't add up to the probability scale).
+    bool SetModel(const std::vector<uint8_t>& model_data);
+    // uses a table made by BuildRansTable in place, e.g. one mapped from a dictionary file.
+    // it has to stay put (and be 4-byte aligned) for as long as the decoder is used.
+    void SetTable(const uint8_t* table);
+    // decodes a whole segmented stream into 'out' with the model from SetModel, using up to 'threads' threads.
+    // returns false if the stream is malformed or holds more than 'max_symbols' symbols.
+    bool DecodeSegmented(const uint8_t* data, size_t size, size_t max_symbols, std::vector<uint8_t>& out,
+                         int threads) const;
+    // decodes symbols [first, first + count) of a segmented stream into 'out' (fewer if the stream ends first),
+    // starting from 'from', the checkpoint taken at 'first'. without one, 'first' has to be the start of a segment.
+    bool DecodeSegmentedRange(const uint8_t* data, size_t size, size_t max_symbols, size_t first, size_t count,
+                              const RansCheckpoint* from, std::vector<uint8_t>& out) const;
+
+private:
+    std::unique_ptr<RansDecoderImpl> impl;
+
+    friend class RansPipeline;
+};
+
+// the decoder's lookup tables for a model, in the layout SetTable takes. they're built once and then only read,
+// so they can be saved to a file (in this machine's byte order) and mapped by any number of decoders.
+size_t RansTableSize();
+// returns false if the model is malformed.
+bool BuildRansTable(const std::vector<uint8_t>& model_data, std::vector<uint8_t>& table);
+
+// decodes a segmented stream on helper threads while the caller reads it front to back,
+// so the symbols and whatever consumes them can be decoded at the same time.
+class RansPipeline {
+public:
+    RansPipeline();
+    // stops the helpers and waits for them.
+    ~RansPipeline();
+
+    // checks the segment table and starts 'threads' helpers on it with 'decoder's model.
+    // returns false if the stream is malformed or holds more than 'max_symbols' symbols.
+    bool Start(const RansDecoder& decoder, const uint8_t* data, size_t size, size_t max_symbols, int threads);
+    // where the symbols are decoded to, and how many there will be.
+    const uint8_t* Data() const;
+    size_t Size() const;
+    // waits until more than 'have' symbols are ready (or all of them are) and returns how many are.
+    size_t Wait(size_t have);
+    // waits for the rest of the stream and returns whether every segment decoded cleanly.
+    bool Finish();
+
+private:
+    std::unique_ptr<RansPipelineImpl> impl;
 };
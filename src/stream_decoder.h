@@ -0,0 +1,83 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "compressor.h"
+#include "format.h"
+#include "file_io.h"
+
+// internal: the block reader that Decompress, DecompressRange and MidoStreambuf are built on.
+// it isn't part of the public api in compressor.h.
+
+// reads a .mido file one block at a time. between blocks only the primed history is kept,
+// so memory use is one block plus prime_size no matter how big the file is.
+// every block is ReadHeader, then exactly one of Decode, Copy or Skip.
+class StreamDecoder {
+public:
+    bool Open(const std::string& path, const DecompressOptions& options = {});
+
+    // the size of the original data, and how much of it the blocks read so far cover.
+    // a streaming frame read from a pipe doesn't know its size, which is then UINT64_MAX.
+    uint64_t Size() const { return size; }
+    uint64_t Position() const { return position; }
+    bool Done() const;
+
+    bool ReadHeader();
+    const BlockHeader& Header() const { return header; }
+    // where the current block starts in the original data.
+    uint64_t BlockStart() const { return block_start; }
+
+    // decodes the block. its bytes stay at Data() until the next block is read, and with options.sparse
+    // ZeroRuns() has its zero runs (relative to Data()).
+    bool Decode();
+    const uint8_t* Data() const { return window.data() + block_offset; }
+    size_t BlockSize() const { return window.size() - block_offset; }
+    const std::vector<ZeroRun>& ZeroRuns() const { return zero_runs; }
+
+    // stored blocks can go straight to an output file instead, unless the input is a pipe that
+    // the next block's primed history would have to be read back from.
+    bool CanCopy() const;
+    bool Copy(OutputFile& out);
+
+    // moves past the block without producing it (primed blocks still get decoded for their history).
+    bool Skip();
+
+    // gets ready to read the block holding original offset 'offset': the next ReadHeader returns it,
+    // or Done() is true if 'offset' is the end of the data. unprimed seekable files jump straight there
+    // through an index of the block headers. otherwise the blocks in between are skipped, starting over
+    // from the first one to go backwards, which a pipe can't do.
+    bool Seek(uint64_t offset);
+
+private:
+    struct IndexEntry {
+        uint64_t file_offset; // where the block header is in the file
+        uint64_t raw_offset;  // where the block starts in the original data
+    };
+
+    DecompressOptions options;
+    InputFile in;
+    FrameHeader frame;
+    const Dictionary* dictionary = nullptr;
+    BlockHeader header;
+    uint64_t size = 0;
+    bool pending = false; // Seek has read 'header' already
+    // the first word of the next header, read early to spot the end of a streaming frame.
+    uint8_t peek[kStoredHeaderSize];
+    bool peeked = false;
+    bool ended = false;
+    uint32_t next_block = 0;
+    uint64_t position = 0;
+    uint64_t block_start = 0;
+    // the primed history followed by the current block, which starts at block_offset.
+    std::vector<uint8_t> window;
+    size_t block_offset = 0;
+    std::vector<uint8_t> payload;
+    std::vector<ZeroRun> zero_runs;
+    std::vector<IndexEntry> index;
+    bool indexed = false;
+    uint64_t indexed_size = 0;
+
+    bool PeekEnd();
+    void Trim();
+    bool BuildIndex();
+};
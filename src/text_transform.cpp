@@ -0,0 +1,299 @@
+#include "text_transform.h"
+#include <algorithm>
+
+// words shorter than this can't get shorter, and longer ones are rare enough not to bother with.
+constexpr size_t kMinWordLength = 2;
+constexpr size_t kMaxWordLength = 32;
+
+// two case markers plus a handful of codes. binary data rarely leaves this many byte values unused.
+constexpr int kMinFreeBytes = 8;
+
+// the transform has to save at least 1/kMinGain of the block, or the block is left alone.
+constexpr size_t kMinGain = 32;
+
+static inline bool IsLetter(uint8_t c) {
+    return (uint8_t)((c | 0x20) - 'a') < 26;
+}
+
+static inline bool IsUpper(uint8_t c) {
+    return (uint8_t)(c - 'A') < 26;
+}
+
+// how a word is written. mixed-case words are left as they are.
+enum class WordCase { kLower, kCapital, kUpper, kMixed };
+
+static WordCase CaseOf(const uint8_t* w, size_t len) {
+    size_t upper = 0;
+    for (size_t i = 0; i < len; ++i) upper += IsUpper(w[i]);
+    if (upper == 0) return WordCase::kLower;
+    if (upper == len) return WordCase::kUpper;
+    if (upper == 1 && IsUpper(w[0])) return WordCase::kCapital;
+    return WordCase::kMixed;
+}
+
+// every distinct word of a block, case folded. open addressing over indices into 'words',
+// which point back at the word's first occurrence in the block.
+class WordTable {
+public:
+    struct Word {
+        uint32_t offset;
+        uint32_t length;
+        uint32_t count;
+        int32_t code; // index in the word list, or -1 if the word isn't in it
+    };
+
+    explicit WordTable(const uint8_t* block) : block(block), slots(4096, -1) {}
+
+    // the word at 'w', added if it's new.
+    Word& Add(const uint8_t* w, size_t len) {
+        int32_t& slot = Slot(w, len);
+        if (slot < 0) {
+            slot = words.size();
+            words.push_back({(uint32_t)(w - block), (uint32_t)len, 0, -1});
+            // keep the table at most half full.
+            if (words.size() * 2 > slots.size()) Grow();
+            return words.back();
+        }
+        return words[slot];
+    }
+
+    // the word at 'w', or null if it was never added.
+    const Word* Find(const uint8_t* w, size_t len) {
+        int32_t slot = Slot(w, len);
+        return slot < 0 ? nullptr : &words[slot];
+    }
+
+    std::vector<Word>& Words() { return words; }
+
+private:
+    const uint8_t* block;
+    std::vector<int32_t> slots;
+    std::vector<Word> words;
+
+    // fnv-1a over the lowercase letters.
+    static uint32_t Hash(const uint8_t* w, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; ++i) h = (h ^ (w[i] | 0x20)) * 16777619u;
+        return h;
+    }
+
+    bool Equal(const Word& word, const uint8_t* w, size_t len) const {
+        if (word.length != len) return false;
+        const uint8_t* v = block + word.offset;
+        for (size_t i = 0; i < len; ++i) {
+            if ((v[i] | 0x20) != (w[i] | 0x20)) return false;
+        }
+        return true;
+    }
+
+    int32_t& Slot(const uint8_t* w, size_t len) {
+        size_t mask = slots.size() - 1;
+        for (size_t i = Hash(w, len) & mask;; i = (i + 1) & mask) {
+            if (slots[i] < 0 || Equal(words[slots[i]], w, len)) return slots[i];
+        }
+    }
+
+    void Grow() {
+        slots.assign(slots.size() * 2, -1);
+        size_t mask = slots.size() - 1;
+        for (size_t s = 0; s < words.size(); ++s) {
+            size_t i = Hash(block + words[s].offset, words[s].length) & mask;
+            while (slots[i] >= 0) i = (i + 1) & mask;
+            slots[i] = s;
+        }
+    }
+};
+
+// calls f(begin, length) for every word of the block that can be coded, in order.
+template <typename F>
+static void ForEachWord(const uint8_t* p, size_t n, const F& f) {
+    size_t i = 0;
+    while (i < n) {
+        if (!IsLetter(p[i])) {
+            i++;
+            continue;
+        }
+        size_t begin = i;
+        while (i < n && IsLetter(p[i])) i++;
+        size_t len = i - begin;
+        if (len >= kMinWordLength && len <= kMaxWordLength && CaseOf(p + begin, len) != WordCase::kMixed) {
+            f(begin, len);
+        }
+    }
+}
+
+bool WordTransform(const uint8_t* p, size_t n, std::vector<uint8_t>& out) {
+    // step 1: count the words, and which byte values turn up at all.
+    bool used[256] = {};
+    for (size_t i = 0; i < n; ++i) used[p[i]] = true;
+    std::vector<uint8_t> free_bytes;
+    for (int c = 0; c < 256; ++c) {
+        if (!used[c]) free_bytes.push_back(c);
+    }
+    if ((int)free_bytes.size() < kMinFreeBytes) return false;
+
+    WordTable table(p);
+    ForEachWord(p, n, [&](size_t begin, size_t len) { table.Add(p + begin, len).count++; });
+
+    // step 2: pick the words. the ones that save the most get the one-byte codes. every word also costs
+    // its length plus one in the list, so a word has to come up often enough to pay for that.
+    std::vector<WordTable::Word*> candidates;
+    for (WordTable::Word& w : table.Words()) {
+        if (w.count >= 2) candidates.push_back(&w);
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const WordTable::Word* a, const WordTable::Word* b) {
+        uint64_t sa = (uint64_t)a->count * (a->length - 1), sb = (uint64_t)b->count * (b->length - 1);
+        return sa != sb ? sa > sb : a->offset < b->offset;
+    });
+    auto saves = [](const WordTable::Word* w, size_t code_length) {
+        return w->length > code_length && (uint64_t)w->count * (w->length - code_length) > w->length + 1;
+    };
+
+    // two bytes go to the case markers. every prefix turns one one-byte code into 256 two-byte ones,
+    // so we take as many as the words that would still pay for two-byte codes need.
+    size_t codes = free_bytes.size() - 2;
+    size_t two_byte = std::count_if(candidates.begin(), candidates.end(),
+                                    [&](const WordTable::Word* w) { return saves(w, 2); });
+    size_t num_prefixes = two_byte > codes ? std::min(codes / 2, (two_byte - codes + 255) / 256) : 0;
+    size_t num_codes = codes - num_prefixes;
+    size_t capacity = num_codes + num_prefixes * 256;
+
+    std::vector<const WordTable::Word*> list;
+    for (WordTable::Word* w : candidates) {
+        if (list.size() == capacity) break;
+        if (!saves(w, list.size() < num_codes ? 1 : 2)) continue;
+        w->code = list.size();
+        list.push_back(w);
+    }
+    if (list.empty()) return false;
+
+    // step 3: write the word list, then the text with the words replaced.
+    uint8_t capital = free_bytes[0];
+    uint8_t upper = free_bytes[1];
+    const uint8_t* code_bytes = free_bytes.data() + 2;
+    const uint8_t* prefixes = code_bytes + num_codes;
+
+    out.clear();
+    out.reserve(n);
+    out.push_back(capital);
+    out.push_back(upper);
+    out.push_back(num_codes);
+    out.insert(out.end(), code_bytes, code_bytes + num_codes);
+    out.push_back(num_prefixes);
+    out.insert(out.end(), prefixes, prefixes + num_prefixes);
+    for (size_t count = list.size(); ; count >>= 7) {
+        out.push_back((count & 0x7F) | (count >= 0x80 ? 0x80 : 0));
+        if (count < 0x80) break;
+    }
+    for (const WordTable::Word* w : list) {
+        out.push_back(w->length);
+        for (size_t i = 0; i < w->length; ++i) out.push_back(p[w->offset + i] | 0x20);
+    }
+
+    size_t copied = 0;
+    ForEachWord(p, n, [&](size_t begin, size_t len) {
+        const WordTable::Word* w = table.Find(p + begin, len);
+        if (w->code < 0) return;
+        out.insert(out.end(), p + copied, p + begin);
+        copied = begin + len;
+        WordCase word_case = CaseOf(p + begin, len);
+        if (word_case == WordCase::kCapital) out.push_back(capital);
+        if (word_case == WordCase::kUpper) out.push_back(upper);
+        if ((size_t)w->code < num_codes) {
+            out.push_back(code_bytes[w->code]);
+        } else {
+            out.push_back(prefixes[(w->code - num_codes) / 256]);
+            out.push_back((w->code - num_codes) % 256);
+        }
+    });
+    out.insert(out.end(), p + copied, p + n);
+    return out.size() + n / kMinGain < n;
+}
+
+// what a byte of the transformed text means.
+enum class ByteRole : uint8_t { kLiteral, kCapital, kUpper, kCode, kPrefix };
+
+bool InverseWordTransform(const uint8_t* p, size_t n, size_t raw_size, std::vector<uint8_t>& out) {
+    const uint8_t* q = p;
+    const uint8_t* const end = p + n;
+
+    // the markers, codes and prefixes all have to be different bytes, or the text would be ambiguous.
+    ByteRole role[256] = {};
+    uint8_t index[256] = {};
+    auto claim = [&](uint8_t c, ByteRole r, size_t i) {
+        if (role[c] != ByteRole::kLiteral) return false;
+        role[c] = r;
+        index[c] = i;
+        return true;
+    };
+    if (end - q < 3 || !claim(q[0], ByteRole::kCapital, 0) || !claim(q[1], ByteRole::kUpper, 0)) return false;
+    q += 2;
+    size_t num_codes = *q++;
+    if ((size_t)(end - q) < num_codes + 1) return false;
+    for (size_t i = 0; i < num_codes; ++i) {
+        if (!claim(*q++, ByteRole::kCode, i)) return false;
+    }
+    size_t num_prefixes = *q++;
+    if ((size_t)(end - q) < num_prefixes) return false;
+    for (size_t i = 0; i < num_prefixes; ++i) {
+        if (!claim(*q++, ByteRole::kPrefix, i)) return false;
+    }
+    uint64_t count = 0;
+    for (int shift = 0;; shift += 7) {
+        if (q == end || shift > 28) return false;
+        uint8_t b = *q++;
+        count |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+    }
+    if (count > num_codes + num_prefixes * 256) return false;
+
+    // the list is only checked here, so expanding a word can trust it.
+    std::vector<const uint8_t*> words(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        if (q == end) return false;
+        size_t len = *q++;
+        if (len < kMinWordLength || len > kMaxWordLength || (size_t)(end - q) < len) return false;
+        for (size_t k = 0; k < len; ++k) {
+            if ((uint8_t)(q[k] - 'a') >= 26) return false;
+        }
+        words[i] = q - 1;
+        q += len;
+    }
+
+    size_t start = out.size();
+    out.reserve(start + raw_size);
+    while (q < end) {
+        uint8_t c = *q++;
+        ByteRole r = role[c];
+        if (r == ByteRole::kLiteral) {
+            out.push_back(c);
+            continue;
+        }
+        WordCase word_case = WordCase::kLower;
+        if (r == ByteRole::kCapital || r == ByteRole::kUpper) {
+            word_case = r == ByteRole::kCapital ? WordCase::kCapital : WordCase::kUpper;
+            if (q == end) return false;
+            c = *q++;
+            r = role[c];
+        }
+        size_t w;
+        if (r == ByteRole::kCode) {
+            w = index[c];
+        } else if (r == ByteRole::kPrefix && q < end) {
+            w = num_codes + index[c] * 256 + *q++;
+        } else {
+            return false;
+        }
+        if (w >= count) return false;
+        const uint8_t* word = words[w];
+        size_t len = word[0];
+        if (out.size() - start + len > raw_size) return false;
+        size_t at = out.size();
+        out.insert(out.end(), word + 1, word + 1 + len);
+        if (word_case == WordCase::kCapital) out[at] -= 0x20;
+        if (word_case == WordCase::kUpper) {
+            for (size_t k = at; k < out.size(); ++k) out[k] -= 0x20;
+        }
+    }
+    return out.size() - start == raw_size;
+}
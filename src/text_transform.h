@@ -0,0 +1,22 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// a reversible word transform for text, run on a block before it's parsed. the block's frequent words
+// are replaced by one or two byte codes made of byte values the block never uses, so nothing else in it
+// needs escaping. a capitalised or all-caps word becomes a case marker followed by the code of its
+// lowercase form. the parse then has fewer bytes to search and sees more repeats in its window.
+//
+// the transformed block starts with its word list:
+// [capital marker] [upper marker] [n1] [n1 codes] [n2] [n2 prefixes] [word count (varint)]
+// then every word as [length] [lowercase letters]. word i is coded as codes[i] if i < n1,
+// otherwise as prefixes[(i - n1) / 256] followed by (i - n1) % 256.
+
+// transforms the 'n' bytes at 'p' into 'out'. returns false if the block doesn't look enough like text
+// to gain from it.
+bool WordTransform(const uint8_t* p, size_t n, std::vector<uint8_t>& out);
+
+// undoes WordTransform, appending the original bytes to 'out'. returns false if 'p' is malformed
+// or doesn't expand to exactly 'raw_size' bytes.
+bool InverseWordTransform(const uint8_t* p, size_t n, size_t raw_size, std::vector<uint8_t>& out);